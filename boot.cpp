@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
 
 #ifdef _WIN32
 #include <io.h>
@@ -9,20 +11,53 @@
 #include <unistd.h>
 #endif
 
-#include "cache.h"
-#include "running.h"
+#include "machine.h"
+#include "server.h"
 
 FILE* biosChip;
 FILE* secondaryStorage;
 
+/// <summary>
+/// Turns the name of a prefetcher given on the command line into its mode.
+/// </summary>
+/// <param name="name"> The name of the prefetcher, none, next-line, stride or stream. </param>
+/// <returns> The prefetcher mode, or PREFETCH_NONE if the name is not recognised. </returns>
+uint8_t parse_prefetcher(const char* name)
+{
+	if (strcmp(name, "next-line") == 0)
+	{
+		return PREFETCH_NEXT_LINE;
+	}
+	else if (strcmp(name, "stride") == 0)
+	{
+		return PREFETCH_STRIDE;
+	}
+	else if (strcmp(name, "stream") == 0)
+	{
+		return PREFETCH_STREAM;
+	}
+	else if (strcmp(name, "none") != 0)
+	{
+		printf("WARNING: unknown prefetcher %s, prefetching is off.\n", name);
+	}
+	return PREFETCH_NONE;
+}
+
 int main(int argc, char* argv[])
 {
 	// startup
+	Machine* machine = create_machine();
+	if (machine == NULL)
+	{
+		printf("FATAL: not enough memory for the machine.\n");
+		return -1;
+	}
 
 	// check if bios chip file exists
 	if (access("bios.sto", F_OK) != 0)
 	{
 		printf("FATAL: BIOS chip not found.\n");
+		destroy_machine(machine);
 		return -1;
 	}
 	else
@@ -31,11 +66,14 @@ int main(int argc, char* argv[])
 		if (biosChip == NULL)
 		{
 			printf("FATAL: BIOS chip not found.\n");
+			destroy_machine(machine);
 			return -1;
 		}
 	}
 
 	// load bios chip contents into ram
+	static uint8_t biosContents[65535];
+	uint16_t biosLength = 0;
 	for (uint16_t index = 0; index < 65535; index++)
 	{
 		uint32_t byte = fgetc(biosChip);
@@ -43,14 +81,127 @@ int main(int argc, char* argv[])
 		{
 			break;
 		}
-		ram[index] = (uint8_t)byte;
+		biosContents[index] = (uint8_t)byte;
+		biosLength++;
 	}
 	fclose(biosChip);
+	write_guest_memory(machine, 0, biosContents, biosLength);
+
+	// check the command line for options
+	uint8_t decoupledCache = 0;
+	uint64_t maxInstructions = UINT64_MAX;
+	const char* serverSocket = NULL;
+	uint32_t poolSize = 4;
+	uint8_t readyPcGiven = 0;
+	uint32_t readyPc = 0;
+	for (int arg = 1; arg < argc; arg++)
+	{
+		if (strcmp(argv[arg], "--decoupled-cache") == 0)
+		{
+			// simulate the caches on helper threads, while the CPU runs against flat RAM
+			decoupledCache = 1;
+		}
+		else if (strncmp(argv[arg], "--prefetch=", 11) == 0)
+		{
+			machine->l1Data.prefetcher.mode = parse_prefetcher(argv[arg] + 11);
+		}
+		else if (strncmp(argv[arg], "--prefetch-program=", 19) == 0)
+		{
+			machine->l1Program.prefetcher.mode = parse_prefetcher(argv[arg] + 19);
+		}
+		else if (strncmp(argv[arg], "--prefetch-degree=", 18) == 0)
+		{
+			int degree = atoi(argv[arg] + 18);
+			degree = degree < 1 ? 1 : (degree > PREFETCH_MAX_DEGREE ? PREFETCH_MAX_DEGREE : degree);
+			machine->l1Data.prefetcher.degree = (uint8_t)degree;
+			machine->l1Program.prefetcher.degree = (uint8_t)degree;
+		}
+		else if (strncmp(argv[arg], "--write-buffer=", 15) == 0)
+		{
+			// the number of evicted lines each write buffer holds before draining, 0 turns it off
+			int size = atoi(argv[arg] + 15);
+			size = size < 0 ? 0 : (size > WRITE_BUFFER_MAX_ENTRIES ? WRITE_BUFFER_MAX_ENTRIES : size);
+			machine->l1Data.writeBuffer.size = (uint8_t)size;
+			machine->l1Program.writeBuffer.size = (uint8_t)size;
+		}
+		else if (strncmp(argv[arg], "--max-instructions=", 19) == 0)
+		{
+			// stop after this many instructions, instead of running forever
+			// with --server this is the limit for each request
+			maxInstructions = strtoull(argv[arg] + 19, NULL, 10);
+		}
+		else if (strncmp(argv[arg], "--server=", 9) == 0)
+		{
+			// serve requests on this Unix socket instead of running the bios program once
+			serverSocket = argv[arg] + 9;
+		}
+		else if (strncmp(argv[arg], "--pool=", 7) == 0)
+		{
+			int size = atoi(argv[arg] + 7);
+			poolSize = size < 1 ? 1 : (uint32_t)size;
+		}
+		else if (strncmp(argv[arg], "--ready-pc=", 11) == 0)
+		{
+			// run the boot code up to this address before the server takes its snapshot, so requests skip it
+			readyPcGiven = 1;
+			readyPc = (uint32_t)strtoul(argv[arg] + 11, NULL, 0);
+		}
+	}
+
+	if (serverSocket != NULL)
+	{
+		// the pool machines are reset by copying their caches, which only works while the CPU thread is the only one touching them
+		if (decoupledCache)
+		{
+			printf("WARNING: the server does not support decoupled cache simulation, running the caches inline.\n");
+		}
+		machine->registers[10] = 225;
+		machine->registers[11] = 60;
+		if (readyPcGiven && run_until(machine, readyPc, maxInstructions) != STOP_PC_REACHED)
+		{
+			printf("FATAL: the boot code did not reach the ready pc.\n");
+			destroy_machine(machine);
+			return -1;
+		}
+		int result = run_server(machine, serverSocket, poolSize, maxInstructions);
+		destroy_machine(machine);
+		return result;
+	}
+
+	// the helper threads read the cache settings, so they can only start once every option is in
+	if (decoupledCache)
+	{
+		start_cache_simulation(machine);
+	}
+
+	// inputs for the program in the bios chip
+	machine->registers[10] = 225;
+	machine->registers[11] = 60;
 
 	// running
-	run_cpu();
+	while (machine->instructionsRetired < maxInstructions)
+	{
+		stopReason reason = run(machine, maxInstructions - machine->instructionsRetired);
+		if (reason == STOP_ECALL)
+		{
+			printf("ecall\n");
+		}
+		else if (reason == STOP_EBREAK)
+		{
+			printf("ebreak\n");
+		}
+		else if (reason == STOP_ACCESS_FAULT)
+		{
+			// the faulting instruction would just fault again, so there is no carrying on
+			printf("access fault at pc 0x%08x\n", machine->pc);
+			break;
+		}
+	}
 
 	// shutdown
+	stop_cache_simulation(machine);
+	print_cache_statistics(machine);
+	destroy_machine(machine);
 
 	return 0;
 }
\ No newline at end of file
@@ -1,42 +1,46 @@
 #include "cache.h"
-
-uint8_t ram[1024 * 1024 * 1024]; // 1GiB RAM
-uint8_t l1CacheData[8192]; // 8KiB L1 Cache for data
-uint8_t l1CacheProgram[8192]; // 8KiB L1 Cache for programs
-l1CacheSet l1CacheDataMetadata[64];
-l1CacheSet l1CacheProgramMetadata[64];
-
-
-
-
+#include "machine.h"
+#include <stdio.h>
+#include <string.h>
 
 /// <summary>
 /// Reads 1 byte from memory at the specified address. Checks the data cache.
 /// </summary>
+/// <param name="machine"> The machine whose memory is being accessed. </param>
 /// <param name="address"> The address of the byte to read. </param>
 /// <returns> The byte found in memory at the address given. </returns>
-uint8_t read_memory_b(uint32_t address)
+uint8_t read_memory_b(Machine* machine, uint32_t address)
 {
-	uint8_t addressOffset = address & 0x0000003f; // last 6 bits of address
+	if (machine->cacheMode == CACHE_MODE_DECOUPLED)
+	{
+		push_cache_access(&machine->dataAccessQueue, address, 1, 0, machine->pc - 4);
+		return machine->ram[address];
+	}
 
-	l1CacheFullLine cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address);
+	uint8_t output = (uint8_t)read_cached_bytes(&machine->l1Data, address, 1);
 
-	return l1CacheData[cacheLine.cacheIndex + addressOffset];
+	train_prefetcher(&machine->l1Data, address, machine->pc - 4); // pc has already moved on to the next instruction
+
+	return output;
 }
 
 /// <summary>
 /// Reads 2 bytes from memory at the specified address. Checks the data cache.
 /// </summary>
+/// <param name="machine"> The machine whose memory is being accessed. </param>
 /// <param name="address"> The address of the left-most byte to read. </param>
 /// <returns> The 2 bytes found in memory at the address given. </returns>
-uint16_t read_memory_s(uint32_t address)
+uint16_t read_memory_s(Machine* machine, uint32_t address)
 {
-	uint8_t addressOffset = address & 0x0000003f; // last 6 bits of address
+	if (machine->cacheMode == CACHE_MODE_DECOUPLED)
+	{
+		push_cache_access(&machine->dataAccessQueue, address, 2, 0, machine->pc - 4);
+		return (machine->ram[address] << 8) | machine->ram[address + 1];
+	}
+
+	uint16_t output = (uint16_t)read_cached_bytes(&machine->l1Data, address, 2);
 
-	l1CacheFullLine cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address);
-	uint16_t output = l1CacheData[cacheLine.cacheIndex + addressOffset] << 8;
-	cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address + 1);
-	output |= l1CacheData[cacheLine.cacheIndex + addressOffset + 1];
+	train_prefetcher(&machine->l1Data, address, machine->pc - 4); // pc has already moved on to the next instruction
 
 	return output;
 }
@@ -44,20 +48,20 @@ uint16_t read_memory_s(uint32_t address)
 /// <summary>
 /// Reads 4 bytes from memory at the specified address. Checks the data cache.
 /// </summary>
+/// <param name="machine"> The machine whose memory is being accessed. </param>
 /// <param name="address"> The address of the left-most byte to read. </param>
 /// <returns> The 4 bytes found in memory at the address given. </returns>
-uint32_t read_memory_i(uint32_t address)
+uint32_t read_memory_i(Machine* machine, uint32_t address)
 {
-	uint8_t addressOffset = address & 0x0000003f; // last 6 bits of address
+	if (machine->cacheMode == CACHE_MODE_DECOUPLED)
+	{
+		push_cache_access(&machine->dataAccessQueue, address, 4, 0, machine->pc - 4);
+		return (machine->ram[address] << 24) | (machine->ram[address + 1] << 16) | (machine->ram[address + 2] << 8) | machine->ram[address + 3];
+	}
+
+	uint32_t output = read_cached_bytes(&machine->l1Data, address, 4);
 
-	l1CacheFullLine cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address);
-	uint32_t output = l1CacheData[cacheLine.cacheIndex + addressOffset] << 24;
-	cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address + 1);
-	output |= l1CacheData[cacheLine.cacheIndex + addressOffset + 1] << 16;
-	cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address + 2);
-	output |= l1CacheData[cacheLine.cacheIndex + addressOffset + 2] << 8;
-	cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address + 3);
-	output |= l1CacheData[cacheLine.cacheIndex + addressOffset + 3];
+	train_prefetcher(&machine->l1Data, address, machine->pc - 4); // pc has already moved on to the next instruction
 
 	return output;
 }
@@ -65,20 +69,20 @@ uint32_t read_memory_i(uint32_t address)
 /// <summary>
 /// Reads an opcode (4 bytes) from memory. Checks the program cache.
 /// </summary>
+/// <param name="machine"> The machine whose memory is being accessed. </param>
 /// <param name="address"> The address of the left-most byte of the opcode to read. </param>
 /// <returns> The opcode found in memory at the address given. </returns>
-uint32_t read_program_memory(uint32_t address)
+uint32_t read_program_memory(Machine* machine, uint32_t address)
 {
-	uint8_t addressOffset = address & 0x0000003f; // last 6 bits of address
+	if (machine->cacheMode == CACHE_MODE_DECOUPLED)
+	{
+		push_cache_access(&machine->programAccessQueue, address, 4, 0, address);
+		return (machine->ram[address] << 24) | (machine->ram[address + 1] << 16) | (machine->ram[address + 2] << 8) | machine->ram[address + 3];
+	}
+
+	uint32_t output = read_cached_bytes(&machine->l1Program, address, 4);
 
-	l1CacheFullLine cacheLine = get_cache_line(l1CacheProgram, l1CacheProgramMetadata, address);
-	uint32_t output = l1CacheProgram[cacheLine.cacheIndex + addressOffset] << 24;
-	cacheLine = get_cache_line(l1CacheProgram, l1CacheProgramMetadata, address + 1);
-	output |= l1CacheProgram[cacheLine.cacheIndex + addressOffset + 1] << 16;
-	cacheLine = get_cache_line(l1CacheProgram, l1CacheProgramMetadata, address + 2);
-	output |= l1CacheProgram[cacheLine.cacheIndex + addressOffset + 2] << 8;
-	cacheLine = get_cache_line(l1CacheProgram, l1CacheProgramMetadata, address + 3);
-	output |= l1CacheProgram[cacheLine.cacheIndex + addressOffset + 3];
+	train_prefetcher(&machine->l1Program, address, address);
 
 	return output;
 }
@@ -90,77 +94,138 @@ uint32_t read_program_memory(uint32_t address)
 /// <summary>
 /// Writes 1 byte to memory, at the given address.
 /// </summary>
+/// <param name="machine"> The machine whose memory is being accessed. </param>
 /// <param name="address"> The destination address in memory. </param>
 /// <param name="data"> The data that is to be written to memory. </param>
-void write_memory_b(uint32_t address, uint8_t data)
+void write_memory_b(Machine* machine, uint32_t address, uint8_t data)
 {
-	uint8_t addressOffset = address & 0x0000003f; // last 6 bits of address
+	if (machine->cacheMode == CACHE_MODE_DECOUPLED)
+	{
+		push_cache_access(&machine->dataAccessQueue, address, 1, 1, machine->pc - 4);
+		mark_page_dirty(&machine->dirtyPages, address);
+		machine->ram[address] = data;
+		return;
+	}
 
-	l1CacheFullLine cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address);
-	cacheLine.metadata->dirty = 1;
+	write_cached_bytes(&machine->l1Data, address, 1, data);
 
-	l1CacheData[cacheLine.cacheIndex + addressOffset] = data;
+	train_prefetcher(&machine->l1Data, address, machine->pc - 4);
 }
 
 /// <summary>
 /// Writes 2 bytes to memory, starting at the given address.
 /// </summary>
+/// <param name="machine"> The machine whose memory is being accessed. </param>
 /// <param name="address"> The destination address in memory of the first byte to be written. </param>
 /// <param name="data"> The data that is to be written to memory. </param>
-void write_memory_s(uint32_t address, uint16_t data)
+void write_memory_s(Machine* machine, uint32_t address, uint16_t data)
 {
-	uint8_t addressOffset = address & 0x0000003f; // last 6 bits of address
+	if (machine->cacheMode == CACHE_MODE_DECOUPLED)
+	{
+		push_cache_access(&machine->dataAccessQueue, address, 2, 1, machine->pc - 4);
+		mark_page_dirty(&machine->dirtyPages, address);
+		mark_page_dirty(&machine->dirtyPages, address + 1);
+		machine->ram[address] = (uint8_t)(data >> 8 & 0x00ff);
+		machine->ram[address + 1] = (uint8_t)(data & 0x00ff);
+		return;
+	}
 
-	l1CacheFullLine cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address);
-	cacheLine.metadata->dirty = 1;
-	l1CacheData[cacheLine.cacheIndex + addressOffset] = (uint8_t)(data >> 8 & 0x00ff);
-	cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address + 1);
-	cacheLine.metadata->dirty = 1;
-	l1CacheData[cacheLine.cacheIndex + addressOffset + 1] = (uint8_t)(data & 0x00ff);
+	write_cached_bytes(&machine->l1Data, address, 2, data);
+
+	train_prefetcher(&machine->l1Data, address, machine->pc - 4);
 }
 
 /// <summary>
 /// Writes 4 bytes to memory, starting at the given address.
 /// </summary>
+/// <param name="machine"> The machine whose memory is being accessed. </param>
 /// <param name="address"> The destination address in memory of the first byte to be written. </param>
 /// <param name="data"> The data that is to be written to memory. </param>
-void write_memory_i(uint32_t address, uint32_t data)
+void write_memory_i(Machine* machine, uint32_t address, uint32_t data)
 {
-	uint8_t addressOffset = address & 0x0000003f; // last 6 bits of address
+	if (machine->cacheMode == CACHE_MODE_DECOUPLED)
+	{
+		push_cache_access(&machine->dataAccessQueue, address, 4, 1, machine->pc - 4);
+		mark_page_dirty(&machine->dirtyPages, address);
+		mark_page_dirty(&machine->dirtyPages, address + 3);
+		machine->ram[address] = (uint8_t)(data >> 24 & 0x00ff);
+		machine->ram[address + 1] = (uint8_t)(data >> 16 & 0x00ff);
+		machine->ram[address + 2] = (uint8_t)(data >> 8 & 0x00ff);
+		machine->ram[address + 3] = (uint8_t)(data & 0x00ff);
+		return;
+	}
 
-	l1CacheFullLine cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address);
-	cacheLine.metadata->dirty = 1;
-	l1CacheData[cacheLine.cacheIndex + addressOffset] = (uint8_t)(data >> 24 & 0x00ff);
-	cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address + 1);
-	cacheLine.metadata->dirty = 1;
-	l1CacheData[cacheLine.cacheIndex + addressOffset + 1] = (uint8_t)(data >> 16 & 0x00ff);
-	cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address + 1);
-	cacheLine.metadata->dirty = 1;
-	l1CacheData[cacheLine.cacheIndex + addressOffset + 2] = (uint8_t)(data >> 8 & 0x00ff);
-	cacheLine = get_cache_line(l1CacheData, l1CacheDataMetadata, address + 1);
-	cacheLine.metadata->dirty = 1;
-	l1CacheData[cacheLine.cacheIndex + addressOffset + 3] = (uint8_t)(data & 0x00ff);
+	write_cached_bytes(&machine->l1Data, address, 4, data);
+
+	train_prefetcher(&machine->l1Data, address, machine->pc - 4);
 }
 
 
 
 
 
+/// <summary>
+/// Reads up to 4 bytes through a cache, most significant byte first. Each line the bytes cover is looked up once, so a load or fetch counts as one hit or miss, or two if it runs across a line boundary.
+/// </summary>
+/// <param name="cache"> The cache to read through. </param>
+/// <param name="address"> The address of the left-most byte to read. </param>
+/// <param name="size"> The number of bytes to read, 1 to 4. </param>
+/// <returns> The bytes read, in the low bits. </returns>
+uint32_t read_cached_bytes(l1Cache* cache, uint32_t address, uint8_t size)
+{
+	l1CacheFullLine cacheLine = get_cache_line(cache, address);
+	uint32_t output = 0;
+	for (uint8_t byte = 0; byte < size; byte++)
+	{
+		uint32_t byteAddress = address + byte;
+		if (byte > 0 && (byteAddress & 0x3f) == 0)
+		{
+			// the access runs on into the next line, which is in a different set so the first line stays put
+			cacheLine = get_cache_line(cache, byteAddress);
+		}
+		output = (output << 8) | cache->data[cacheLine.cacheIndex + (byteAddress & 0x3f)];
+	}
+	return output;
+}
+
+/// <summary>
+/// Writes up to 4 bytes through a cache, most significant byte first, marking each line written to as dirty. Each line the bytes cover is looked up once, as in read_cached_bytes().
+/// </summary>
+/// <param name="cache"> The cache to write through. </param>
+/// <param name="address"> The address of the left-most byte to write. </param>
+/// <param name="size"> The number of bytes to write, 1 to 4. </param>
+/// <param name="data"> The bytes to write, in the low bits. </param>
+void write_cached_bytes(l1Cache* cache, uint32_t address, uint8_t size, uint32_t data)
+{
+	l1CacheFullLine cacheLine = get_cache_line(cache, address);
+	cacheLine.metadata->dirty = 1;
+	for (uint8_t byte = 0; byte < size; byte++)
+	{
+		uint32_t byteAddress = address + byte;
+		if (byte > 0 && (byteAddress & 0x3f) == 0)
+		{
+			cacheLine = get_cache_line(cache, byteAddress);
+			cacheLine.metadata->dirty = 1;
+		}
+		cache->data[cacheLine.cacheIndex + (byteAddress & 0x3f)] = (uint8_t)(data >> ((size - 1 - byte) * 8));
+	}
+}
+
 /// <summary>
 /// Looks up the given address in the cache metadata. If the containing cache line is in the cache, then it retrieves it. If not, it copies the cache line from RAM into the cache and the retrieves it.
 /// </summary>
-/// <param name="cache"> The cache to copy data from RAM into if required. </param>
-/// <param name="metadata"> The metadata to look up the address in. </param>
+/// <param name="cache"> The cache to look the address up in, and copy data from RAM into if required. </param>
 /// <param name="address"> The memory address to search for in the cache. </param>
 /// <returns> A struct containing a pointer to the metadata entry, and an index into the cache where the line starts. </returns>
-l1CacheFullLine get_cache_line(uint8_t* cache, l1CacheSet* metadata, uint32_t address)
+l1CacheFullLine get_cache_line(l1Cache* cache, uint32_t address)
 {
 	// extract the tag and index from the address, as these are used to locate the correct cache line
 	uint32_t tag = (uint32_t)(address >> 12); // last 20 bits
 	uint8_t index = (uint8_t)((address >> 6) & 0x003f); // middle 6 bits
 
 	// grab the part of the cache metadata that relates to the index
-	l1CacheSet* set = &(metadata[index]);
+	l1CacheSet* set = &(cache->metadata[index]);
+	l1CacheStats* stats = &cache->stats;
 
 	l1CacheFullLine output = { NULL, 0 };
 
@@ -171,73 +236,267 @@ l1CacheFullLine get_cache_line(uint8_t* cache, l1CacheSet* metadata, uint32_t ad
 	{
 		// read/write from line0
 		output.metadata = &set->line0;
+		set->LRU = 1;
 	}
 	else if (set->line1.valid && set->line1.tag == tag)
 	{
 		// read/write from line1
 		output.metadata = &set->line1;
 		output.cacheIndex += 64;
+		set->LRU = 0;
+	}
+	else
+	{
+		// cache miss
+		stats->misses++;
+		cache->prefetcher.triggered = 1;
+		return fill_cache_line(cache, address);
 	}
 
-	// cache miss
-	else if (!set->line0.valid)
+	stats->hits++;
+	if (output.metadata->prefetched)
 	{
-		// copy from ram into line0
-		uint32_t ramAddress = (tag << 12) + (index << 6); // get the start of the line in ram
-		read_ram(cache, output.cacheIndex, ramAddress);
-		set->line0.tag = tag;
-		// read/write from line0
-		output.metadata = &set->line0;
-		set->line0.valid = 1;
+		// the first demand access to a prefetched line, so the prefetch saved a miss
+		output.metadata->prefetched = 0;
+		stats->prefetchesUseful++;
+		cache->prefetcher.triggered = 1;
+	}
+
+	return output;
+}
+
+/// <summary>
+/// Brings the line containing the given address into the cache, in an empty line if the set has one, otherwise in place of the least recently used line. A dirty line being replaced is written back first.
+/// </summary>
+/// <param name="cache"> The cache to copy data from RAM into. </param>
+/// <param name="address"> A memory address in the line to bring in. </param>
+/// <returns> A struct containing a pointer to the metadata entry, and an index into the cache where the line starts. </returns>
+l1CacheFullLine fill_cache_line(l1Cache* cache, uint32_t address)
+{
+	uint32_t tag = (uint32_t)(address >> 12);
+	uint8_t index = (uint8_t)((address >> 6) & 0x003f);
+	l1CacheSet* set = &(cache->metadata[index]);
+	l1CacheStats* stats = &cache->stats;
+
+	// pick the line to replace
+	uint8_t lineNumber = set->LRU;
+	if (!set->line0.valid)
+	{
+		lineNumber = 0;
 	}
 	else if (!set->line1.valid)
 	{
-		// copy from ram into line1
-		output.cacheIndex += 64;
-		uint32_t ramAddress = (tag << 12) + (index << 6);
-		read_ram(cache, output.cacheIndex, ramAddress); // get the start of the line in ram
-		set->line1.tag = tag;
-		// read/write from line1
-		output.metadata = &set->line1;
-		set->line1.valid = 1;
+		lineNumber = 1;
 	}
 
-	// cache eviction required
-	else if (set->LRU = 0)
+	l1CacheFullLine output = { NULL, 0 };
+	output.metadata = lineNumber ? &set->line1 : &set->line0;
+	output.cacheIndex = (index << 7) + (lineNumber << 6);
+
+	l1CacheEntry* line = output.metadata;
+	if (line->valid)
 	{
 		// write to ram if required
-		uint32_t ramAddress = (set->line0.tag << 12) + (index << 6);
-		if (set->line0.dirty)
+		if (line->dirty)
 		{
-			write_ram(cache, ramAddress, output.cacheIndex);
+			write_back_line(cache, output.cacheIndex, (line->tag << 12) + (index << 6));
+			stats->writebacks++;
+		}
+		if (line->prefetched)
+		{
+			stats->prefetchesUnused++;
 		}
-		// copy from ram into line0
-		ramAddress = (tag << 12) + (index << 6);
-		read_ram(cache, output.cacheIndex, ramAddress);
-		set->line0.tag = tag;
-		set->line0.dirty = 0;
-		// read/write from line0
-		output.metadata = &set->line0;
 	}
-	else if (set->LRU = 1)
+
+	// copy from ram into the line
+	read_line(cache, output.cacheIndex, (tag << 12) + (index << 6));
+	line->tag = tag;
+	line->valid = 1;
+	line->dirty = 0;
+	line->prefetched = 0;
+
+	// the other line is now the least recently used
+	set->LRU = !lineNumber;
+
+	return output;
+}
+
+/// <summary>
+/// Brings the line containing the given address into the cache ahead of a demand access, unless it is already there.
+/// </summary>
+/// <param name="cache"> The cache to prefetch into. </param>
+/// <param name="address"> A memory address in the line to prefetch. </param>
+void prefetch_cache_line(l1Cache* cache, uint32_t address)
+{
+	// don't prefetch past the end of RAM
+	if (address >= RAM_SIZE)
 	{
-		// write to ram if required
-		output.cacheIndex += 64;
-		uint32_t ramAddress = (set->line1.tag << 12) + (index << 6);
-		if (set->line1.dirty)
+		return;
+	}
+
+	uint32_t tag = (uint32_t)(address >> 12);
+	uint8_t index = (uint8_t)((address >> 6) & 0x003f);
+	l1CacheSet* set = &(cache->metadata[index]);
+
+	if ((set->line0.valid && set->line0.tag == tag) || (set->line1.valid && set->line1.tag == tag))
+	{
+		return;
+	}
+
+	l1CacheFullLine cacheLine = fill_cache_line(cache, address);
+	cacheLine.metadata->prefetched = 1;
+	cache->stats.prefetchesIssued++;
+}
+
+
+
+
+
+/// <summary>
+/// Finds where the data for a line is held in the cache, if the cache holds it.
+/// </summary>
+/// <param name="cache"> The cache to look in. </param>
+/// <param name="lineAddress"> The address of the first byte of the line. </param>
+/// <returns> A pointer to the first byte of the line in the cache, or NULL if the cache does not hold the line's data. </returns>
+uint8_t* find_cached_line(l1Cache* cache, uint32_t lineAddress)
+{
+	if (cache->tagsOnly)
+	{
+		return NULL;
+	}
+
+	uint32_t tag = (uint32_t)(lineAddress >> 12);
+	uint8_t index = (uint8_t)((lineAddress >> 6) & 0x003f);
+	l1CacheSet* set = &(cache->metadata[index]);
+
+	if (set->line0.valid && set->line0.tag == tag)
+	{
+		return &cache->data[index << 7];
+	}
+	else if (set->line1.valid && set->line1.tag == tag)
+	{
+		return &cache->data[(index << 7) + 64];
+	}
+	return NULL;
+}
+
+/// <summary>
+/// Finds where the data for a line is held in the write buffer, if it is waiting there.
+/// </summary>
+/// <param name="cache"> The cache that owns the write buffer. </param>
+/// <param name="lineAddress"> The address of the first byte of the line. </param>
+/// <returns> A pointer to the first byte of the line in the write buffer, or NULL if it is not waiting there. </returns>
+uint8_t* find_buffered_line(l1Cache* cache, uint32_t lineAddress)
+{
+	if (cache->tagsOnly)
+	{
+		return NULL;
+	}
+
+	l1WriteBuffer* writeBuffer = &cache->writeBuffer;
+	for (uint8_t entry = 0; entry < writeBuffer->count; entry++)
+	{
+		if (writeBuffer->entries[entry].lineAddress == lineAddress)
 		{
-			write_ram(cache, ramAddress, output.cacheIndex);
+			return writeBuffer->entries[entry].data;
 		}
-		// copy from ram into line1
-		ramAddress = (tag << 12) + (index << 6);
-		read_ram(cache, output.cacheIndex, ramAddress);
-		set->line1.tag = tag;
-		set->line1.dirty = 0;
-		// read/write from line1
-		output.metadata = &set->line1;
 	}
+	return NULL;
+}
 
-	return output;
+
+
+
+
+/// <summary>
+/// Copies a line into the cache, from the write buffer if it is waiting there, otherwise from RAM.
+/// </summary>
+/// <param name="cache"> The cache for the line to copy into. </param>
+/// <param name="cacheIndex"> The index into the cache where the first byte should be copied into. </param>
+/// <param name="lineAddress"> The address of the first byte of the line. </param>
+void read_line(l1Cache* cache, uint32_t cacheIndex, uint32_t lineAddress)
+{
+	if (cache->tagsOnly)
+	{
+		return;
+	}
+
+	uint8_t* bufferedLine = find_buffered_line(cache, lineAddress);
+	if (bufferedLine != NULL)
+	{
+		memcpy(&cache->data[cacheIndex], bufferedLine, 64);
+		return;
+	}
+	read_ram(cache, cacheIndex, lineAddress);
+}
+
+/// <summary>
+/// Writes a dirty line back through the write buffer. If the line is already waiting in the buffer the two writes are combined, otherwise it takes a new entry, draining the buffer first if it is full.
+/// </summary>
+/// <param name="cache"> The cache for the line to be copied from. </param>
+/// <param name="cacheIndex"> The index into the cache where the first byte should be taken from. </param>
+/// <param name="lineAddress"> The address in RAM that the line belongs at. </param>
+void write_back_line(l1Cache* cache, uint32_t cacheIndex, uint32_t lineAddress)
+{
+	l1WriteBuffer* writeBuffer = &cache->writeBuffer;
+	if (writeBuffer->size == 0)
+	{
+		write_ram(cache, cacheIndex, lineAddress);
+		return;
+	}
+
+	// in decoupled mode the buffer only tracks line addresses, RAM already holds the data
+	uint8_t copyData = !cache->tagsOnly;
+
+	for (uint8_t entry = 0; entry < writeBuffer->count; entry++)
+	{
+		if (writeBuffer->entries[entry].lineAddress == lineAddress)
+		{
+			if (copyData)
+			{
+				memcpy(writeBuffer->entries[entry].data, &cache->data[cacheIndex], 64);
+			}
+			cache->stats.writesCombined++;
+			return;
+		}
+	}
+
+	if (writeBuffer->count >= writeBuffer->size)
+	{
+		drain_write_buffer(cache);
+	}
+
+	writeBufferEntry* entry = &writeBuffer->entries[writeBuffer->count];
+	entry->lineAddress = lineAddress;
+	if (copyData)
+	{
+		memcpy(entry->data, &cache->data[cacheIndex], 64);
+	}
+	writeBuffer->count++;
+}
+
+/// <summary>
+/// Writes every line waiting in the write buffer to RAM, and empties it.
+/// </summary>
+/// <param name="cache"> The cache that owns the write buffer. </param>
+void drain_write_buffer(l1Cache* cache)
+{
+	l1WriteBuffer* writeBuffer = &cache->writeBuffer;
+	if (writeBuffer->count == 0)
+	{
+		return;
+	}
+
+	if (!cache->tagsOnly)
+	{
+		for (uint8_t entry = 0; entry < writeBuffer->count; entry++)
+		{
+			memcpy(&cache->ram[writeBuffer->entries[entry].lineAddress], writeBuffer->entries[entry].data, 64);
+			mark_page_dirty(cache->dirtyPages, writeBuffer->entries[entry].lineAddress);
+		}
+	}
+	writeBuffer->count = 0;
+	cache->stats.writeBufferDrains++;
 }
 
 /// <summary>
@@ -246,12 +505,15 @@ l1CacheFullLine get_cache_line(uint8_t* cache, l1CacheSet* metadata, uint32_t ad
 /// <param name="cache"> The cache for the RAM to copy into. </param>
 /// <param name="cacheIndex"> The index into the cache where the first byte should be copied into. </param>
 /// <param name="lineAddress"> The index into the RAM where the first byte should be taken from. </param>
-void read_ram(uint8_t* cache, uint32_t cacheIndex, uint32_t lineAddress)
+void read_ram(l1Cache* cache, uint32_t cacheIndex, uint32_t lineAddress)
 {
-	for (int byte = 0; byte < 64; byte++)
+	// in decoupled mode the caches only track tags, RAM always holds the real data
+	if (cache->tagsOnly)
 	{
-		cache[cacheIndex + byte] = ram[lineAddress + byte];
+		return;
 	}
+
+	memcpy(&cache->data[cacheIndex], &cache->ram[lineAddress], 64);
 }
 
 /// <summary>
@@ -260,10 +522,69 @@ void read_ram(uint8_t* cache, uint32_t cacheIndex, uint32_t lineAddress)
 /// <param name="cache"> The cache for the RAM to be copied from. </param>
 /// <param name="cacheIndex"> The index into the cache where the first byte should be taken from. </param>
 /// <param name="lineAddress"> The index into the RAM where the first byte should be copied into. </param>
-void write_ram(uint8_t* cache, uint32_t cacheIndex, uint32_t lineAddress)
+void write_ram(l1Cache* cache, uint32_t cacheIndex, uint32_t lineAddress)
+{
+	if (cache->tagsOnly)
+	{
+		return;
+	}
+
+	memcpy(&cache->ram[lineAddress], &cache->data[cacheIndex], 64);
+	mark_page_dirty(cache->dirtyPages, lineAddress);
+}
+
+
+
+
+
+/// <summary>
+/// Prints the statistics for one cache.
+/// </summary>
+/// <param name="name"> The name to print for the cache. </param>
+/// <param name="cache"> The cache to print the statistics of. </param>
+void print_cache_stats(const char* name, l1Cache* cache)
+{
+	l1CacheStats* stats = &cache->stats;
+	uint64_t accesses = stats->hits + stats->misses;
+	printf("%s: %llu hits, %llu misses (%.2f%% miss rate), %llu writebacks\n", name,
+		(unsigned long long)stats->hits, (unsigned long long)stats->misses,
+		accesses ? 100.0 * stats->misses / accesses : 0.0, (unsigned long long)stats->writebacks);
+
+	if (stats->prefetchesIssued)
+	{
+		// prefetched lines still in the cache have not been used either, they just have not been evicted yet
+		uint64_t stillCached = 0;
+		for (uint8_t index = 0; index < 64; index++)
+		{
+			stillCached += cache->metadata[index].line0.valid && cache->metadata[index].line0.prefetched;
+			stillCached += cache->metadata[index].line1.valid && cache->metadata[index].line1.prefetched;
+		}
+
+		// accuracy is how many prefetches were used, coverage is how many of the misses there would have been were removed
+		uint64_t missesWithoutPrefetch = stats->misses + stats->prefetchesUseful;
+		printf("  prefetches: %llu issued, %llu useful, %llu unused (%llu evicted, %llu still cached) (%.2f%% accuracy, %.2f%% coverage)\n",
+			(unsigned long long)stats->prefetchesIssued, (unsigned long long)stats->prefetchesUseful,
+			(unsigned long long)(stats->prefetchesUnused + stillCached), (unsigned long long)stats->prefetchesUnused, (unsigned long long)stillCached,
+			100.0 * stats->prefetchesUseful / stats->prefetchesIssued,
+			missesWithoutPrefetch ? 100.0 * stats->prefetchesUseful / missesWithoutPrefetch : 0.0);
+	}
+	if (stats->writesCombined || stats->writeBufferDrains)
+	{
+		printf("  write buffer: %llu writes combined, %llu drains\n",
+			(unsigned long long)stats->writesCombined, (unsigned long long)stats->writeBufferDrains);
+	}
+}
+
+/// <summary>
+/// Prints the statistics for both L1 caches of a machine.
+/// </summary>
+/// <param name="machine"> The machine to print the statistics of. </param>
+void print_cache_statistics(Machine* machine)
 {
-	for (int byte = 0; byte < 64; byte++)
+	if (machine->cacheMode == CACHE_MODE_DECOUPLED)
 	{
-		ram[lineAddress + byte] = cache[cacheIndex + byte];
+		wait_for_cache_simulation(machine);
 	}
+	print_cache_stats("L1 program cache", &machine->l1Program);
+	print_cache_stats("L1 data cache", &machine->l1Data);
 }
\ No newline at end of file
@@ -3,31 +3,87 @@
 
 #include <stdint.h>
 
+#include "prefetch.h"
+
+#define RAM_SIZE (1024 * 1024 * 1024) // 1GiB RAM
+#define RAM_PAGE_SIZE 4096
+#define RAM_PAGES (RAM_SIZE / RAM_PAGE_SIZE)
+
+/*
+remembers which pages of RAM have been written to since the machine was last reset, so a reset only has to copy those pages back
+*/
+struct dirtyPageTracker
+{
+	uint8_t* dirty; // one entry per page, set once the page is in the list
+	uint32_t* pages; // the page numbers of every dirty page, in the order they were first written
+	uint32_t count;
+};
+
 struct l1CacheEntry
 {
 	uint32_t tag;
 	uint8_t valid;
 	uint8_t dirty;
+	uint8_t prefetched; // filled by a prefetch and not used by a demand access yet
 };
 
 struct l1CacheSet
 {
-	uint8_t LRU;
+	uint8_t LRU; // the line to replace next, 0 for line0 and 1 for line1
 	l1CacheEntry line0;
 	l1CacheEntry line1;
 };
 
-struct l1CacheFullLine
+/*
+each cache keeps its own statistics on its own host cache line, because in decoupled mode they are updated by different threads
+*/
+struct alignas(64) l1CacheStats
 {
-	l1CacheEntry* metadata;
-	uint32_t cacheIndex;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t writebacks;
+	uint64_t prefetchesIssued;
+	uint64_t prefetchesUseful; // prefetched lines that a demand access went on to use
+	uint64_t prefetchesUnused; // prefetched lines that were evicted without being used
+	uint64_t writesCombined; // dirty evictions that merged into a line already waiting in the write buffer
+	uint64_t writeBufferDrains;
+};
+
+#define WRITE_BUFFER_MAX_ENTRIES 16
+
+struct writeBufferEntry
+{
+	uint32_t lineAddress;
+	uint8_t data[64];
+};
+
+/*
+dirty lines evicted from a cache wait here instead of going straight to RAM
+when it fills up, every waiting line is written to RAM in one go
+misses check it before RAM, as it can hold newer data
+*/
+struct l1WriteBuffer
+{
+	uint8_t size; // 0 turns the buffer off, so evictions go straight to RAM
+	uint8_t count;
+	writeBufferEntry entries[WRITE_BUFFER_MAX_ENTRIES];
 };
 
-extern uint8_t ram[1024 * 1024 * 1024]; // 1GiB RAM
-extern uint8_t l1CacheData[8192]; // 8KiB L1 Cache for data
-extern uint8_t l1CacheProgram[8192]; // 8KiB L1 Cache for programs
-extern l1CacheSet l1CacheDataMetadata[64];
-extern l1CacheSet l1CacheProgramMetadata[64];
+/*
+everything belonging to one L1 cache
+the data and program caches are both one of these, so the same functions work on either
+*/
+struct l1Cache
+{
+	uint8_t data[8192]; // 8KiB
+	l1CacheSet metadata[64];
+	uint8_t* ram; // the RAM of the machine this cache belongs to
+	dirtyPageTracker* dirtyPages; // the dirty page tracker for that RAM
+	uint8_t tagsOnly; // set in decoupled mode, where RAM always holds the real data and the cache only tracks tags
+	l1WriteBuffer writeBuffer;
+	l1Prefetcher prefetcher;
+	l1CacheStats stats;
+};
 /*
 64 sets in the cache
 each set is 128 bytes
@@ -38,18 +94,65 @@ most significant 20 bits are for the tag
 6 bits after that is for the offset into the entry
 */
 
-uint8_t read_memory_b(uint32_t address);
-uint16_t read_memory_s(uint32_t address);
-uint32_t read_memory_i(uint32_t address);
-uint32_t read_program_memory(uint32_t address);
+struct l1CacheFullLine
+{
+	l1CacheEntry* metadata;
+	uint32_t cacheIndex;
+};
+
+struct Machine;
+
+uint8_t read_memory_b(Machine* machine, uint32_t address);
+uint16_t read_memory_s(Machine* machine, uint32_t address);
+uint32_t read_memory_i(Machine* machine, uint32_t address);
+uint32_t read_program_memory(Machine* machine, uint32_t address);
+
+void write_memory_b(Machine* machine, uint32_t address, uint8_t data);
+void write_memory_s(Machine* machine, uint32_t address, uint16_t data);
+void write_memory_i(Machine* machine, uint32_t address, uint32_t data);
+
+uint32_t read_cached_bytes(l1Cache* cache, uint32_t address, uint8_t size);
+void write_cached_bytes(l1Cache* cache, uint32_t address, uint8_t size, uint32_t data);
+l1CacheFullLine get_cache_line(l1Cache* cache, uint32_t address);
+l1CacheFullLine fill_cache_line(l1Cache* cache, uint32_t address);
+void prefetch_cache_line(l1Cache* cache, uint32_t address);
+uint8_t* find_cached_line(l1Cache* cache, uint32_t lineAddress);
+uint8_t* find_buffered_line(l1Cache* cache, uint32_t lineAddress);
 
-void write_memory_b(uint32_t address, uint8_t data);
-void write_memory_s(uint32_t address, uint16_t data);
-void write_memory_i(uint32_t address, uint32_t data);
+void read_line(l1Cache* cache, uint32_t cacheIndex, uint32_t lineAddress);
+void write_back_line(l1Cache* cache, uint32_t cacheIndex, uint32_t lineAddress);
+void drain_write_buffer(l1Cache* cache);
 
-l1CacheFullLine get_cache_line(uint8_t* cache, l1CacheSet* metadata, uint32_t address);
+void read_ram(l1Cache* cache, uint32_t cacheIndex, uint32_t lineAddress);
+void write_ram(l1Cache* cache, uint32_t cacheIndex, uint32_t lineAddress);
 
-void read_ram(uint8_t* cache, uint32_t cacheIndex, uint32_t lineAddress);
-void write_ram(uint8_t* cache, uint32_t cacheIndex, uint32_t lineAddress);
+void print_cache_statistics(Machine* machine);
+
+/// <summary>
+/// Checks that a block of guest memory lies entirely inside RAM. Every guest access is checked with this before it reaches the caches, so nothing below them has to.
+/// </summary>
+/// <param name="address"> The address of the first byte. </param>
+/// <param name="size"> The number of bytes. </param>
+/// <returns> 1 if the whole block is in RAM, 0 if any of it is not. </returns>
+inline uint8_t address_in_ram(uint32_t address, uint32_t size)
+{
+	return address < RAM_SIZE && size <= RAM_SIZE - address;
+}
+
+/// <summary>
+/// Marks the page containing the given address as written to. This is called by everything that writes to RAM.
+/// </summary>
+/// <param name="tracker"> The dirty page tracker for the RAM being written to. </param>
+/// <param name="address"> The address being written to, which must be in RAM. </param>
+inline void mark_page_dirty(dirtyPageTracker* tracker, uint32_t address)
+{
+	uint32_t page = address / RAM_PAGE_SIZE;
+	if (!tracker->dirty[page])
+	{
+		tracker->dirty[page] = 1;
+		tracker->pages[tracker->count] = page;
+		tracker->count++;
+	}
+}
 
 #endif
\ No newline at end of file
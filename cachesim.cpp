@@ -0,0 +1,134 @@
+#include "cachesim.h"
+#include "machine.h"
+
+/// <summary>
+/// Switches a machine to decoupled cache simulation, and starts one helper thread for each of its L1 caches.
+/// This must be called before the machine starts running, as the caches only hold tags from then on. Calling it again while the helpers are running does nothing.
+/// </summary>
+/// <param name="machine"> The machine to simulate the caches of. </param>
+void start_cache_simulation(Machine* machine)
+{
+	if (machine->helpersRunning.load(std::memory_order_acquire))
+	{
+		return;
+	}
+	machine->cacheMode = CACHE_MODE_DECOUPLED;
+	machine->l1Data.tagsOnly = 1;
+	machine->l1Program.tagsOnly = 1;
+	machine->helpersRunning.store(1, std::memory_order_release);
+	machine->programCacheHelper = std::thread(run_cache_helper, machine, &machine->programAccessQueue, &machine->l1Program);
+	machine->dataCacheHelper = std::thread(run_cache_helper, machine, &machine->dataAccessQueue, &machine->l1Data);
+}
+
+/// <summary>
+/// Lets the helper threads finish off their queues, then stops them.
+/// </summary>
+/// <param name="machine"> The machine to stop the helpers of. </param>
+void stop_cache_simulation(Machine* machine)
+{
+	if (!machine->helpersRunning.load(std::memory_order_acquire))
+	{
+		return;
+	}
+	machine->helpersRunning.store(0, std::memory_order_release);
+	wake_cache_helper(&machine->programAccessQueue);
+	wake_cache_helper(&machine->dataAccessQueue);
+	machine->programCacheHelper.join();
+	machine->dataCacheHelper.join();
+}
+
+/// <summary>
+/// Waits until the helper threads have caught up with every access the CPU thread has made.
+/// Once this returns the helpers are idle until the CPU thread pushes another access, so the cache state and counters can be read safely.
+/// </summary>
+/// <param name="machine"> The machine to wait for. </param>
+void wait_for_cache_simulation(Machine* machine)
+{
+	cacheAccessQueue* programQueue = &machine->programAccessQueue;
+	cacheAccessQueue* dataQueue = &machine->dataAccessQueue;
+	uint32_t programTail = programQueue->tail.load(std::memory_order_relaxed);
+	uint32_t dataTail = dataQueue->tail.load(std::memory_order_relaxed);
+	// in case either helper missed the wake up for its last records
+	wake_cache_helper(programQueue);
+	wake_cache_helper(dataQueue);
+	while (programQueue->head.load(std::memory_order_acquire) != programTail || dataQueue->head.load(std::memory_order_acquire) != dataTail)
+	{
+		std::this_thread::yield();
+	}
+}
+
+/// <summary>
+/// Wakes a helper thread that is sleeping on its queue. Does nothing if it is awake.
+/// </summary>
+/// <param name="queue"> The queue the helper consumes. </param>
+void wake_cache_helper(cacheAccessQueue* queue)
+{
+	std::lock_guard<std::mutex> lock(queue->sleepLock);
+	queue->wakeUp.notify_one();
+}
+
+/// <summary>
+/// The body of a helper thread. It takes accesses off the queue in batches and runs each line they cover through get_cache_line(), the same way the inline read/write functions do, so the cache state, counters and prefetches end up the same.
+/// </summary>
+/// <param name="machine"> The machine the cache belongs to. </param>
+/// <param name="queue"> The queue to consume accesses from. </param>
+/// <param name="cache"> The cache that the accesses go to. </param>
+void run_cache_helper(Machine* machine, cacheAccessQueue* queue, l1Cache* cache)
+{
+	uint32_t head = queue->head.load(std::memory_order_relaxed);
+	uint32_t idleSpins = 0;
+	while (true)
+	{
+		uint32_t tail = queue->tail.load(std::memory_order_acquire);
+		if (head == tail)
+		{
+			// only stop once the queue is empty, so no accesses are lost
+			if (!machine->helpersRunning.load(std::memory_order_acquire) && queue->tail.load(std::memory_order_acquire) == head)
+			{
+				return;
+			}
+
+			// spin for a short while, as the CPU thread usually pushes again soon, then sleep until woken
+			if (idleSpins < CACHE_HELPER_SPINS)
+			{
+				idleSpins++;
+				std::this_thread::yield();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(queue->sleepLock);
+			queue->sleeping.store(1, std::memory_order_seq_cst);
+			queue->wakeUp.wait_for(lock, std::chrono::milliseconds(CACHE_HELPER_SLEEP_MS), [&]()
+			{
+				return queue->tail.load(std::memory_order_acquire) != head || !machine->helpersRunning.load(std::memory_order_acquire);
+			});
+			queue->sleeping.store(0, std::memory_order_relaxed);
+			continue;
+		}
+		idleSpins = 0;
+
+		while (head != tail)
+		{
+			cacheAccessRecord* record = &queue->records[head & (CACHE_ACCESS_QUEUE_SIZE - 1)];
+			// look up each line the access covers once, the same as read_cached_bytes() and write_cached_bytes()
+			l1CacheFullLine cacheLine = get_cache_line(cache, record->address);
+			if (record->write)
+			{
+				cacheLine.metadata->dirty = 1;
+			}
+			uint32_t lastByte = record->address + record->size - 1;
+			if ((lastByte & 0xffffffc0) != (record->address & 0xffffffc0))
+			{
+				cacheLine = get_cache_line(cache, lastByte);
+				if (record->write)
+				{
+					cacheLine.metadata->dirty = 1;
+				}
+			}
+			train_prefetcher(cache, record->address, record->pc);
+			head++;
+		}
+
+		// release the whole batch at once, so the CPU thread can reuse the slots
+		queue->head.store(head, std::memory_order_release);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,90 @@
+#ifndef CACHESIM_H
+#define CACHESIM_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "cache.h"
+
+#define CACHE_ACCESS_QUEUE_SIZE 65536 // must be a power of 2
+#define CACHE_HELPER_SPINS 1024 // how many times an idle helper checks its queue before it goes to sleep
+#define CACHE_HELPER_SLEEP_MS 1 // the longest a sleeping helper goes without checking its queue, in case a wake up was missed
+
+enum cacheSimulationMode
+{
+	CACHE_MODE_INLINE = 0, // the CPU thread reads and writes through the L1 caches itself
+	CACHE_MODE_DECOUPLED = 1 // the CPU thread uses flat RAM, and helper threads replay its accesses through the cache models
+};
+
+struct cacheAccessRecord
+{
+	uint32_t address;
+	uint32_t pc; // the instruction that made the access, for the stride prefetcher
+	uint8_t size;
+	uint8_t write;
+};
+
+/*
+single producer single consumer ring buffer
+the CPU thread is the only one that moves tail, the helper thread is the only one that moves head
+head and tail only ever count up, and are masked when indexing into records
+a helper that finds its queue empty for a while sleeps on wakeUp, so an idle machine does not keep host cores busy
+*/
+struct cacheAccessQueue
+{
+	alignas(64) std::atomic<uint32_t> tail;
+	uint32_t cachedHead; // the producer's last look at head, so it only has to touch the consumer's cache line when the queue looks full
+	alignas(64) std::atomic<uint32_t> head;
+	alignas(64) std::atomic<uint8_t> sleeping; // set by the helper while it waits on wakeUp, on its own line as the producer reads it on every push
+	std::mutex sleepLock;
+	std::condition_variable wakeUp;
+	alignas(64) cacheAccessRecord records[CACHE_ACCESS_QUEUE_SIZE];
+};
+
+struct Machine;
+
+void start_cache_simulation(Machine* machine);
+void stop_cache_simulation(Machine* machine);
+void wait_for_cache_simulation(Machine* machine);
+void wake_cache_helper(cacheAccessQueue* queue);
+void run_cache_helper(Machine* machine, cacheAccessQueue* queue, l1Cache* cache);
+
+/// <summary>
+/// Adds a memory access onto the end of a queue, for a helper thread to run through the cache model. Waits if the queue is full.
+/// </summary>
+/// <param name="queue"> The queue for the cache that is being accessed. </param>
+/// <param name="address"> The address of the first byte accessed. </param>
+/// <param name="size"> The number of bytes accessed. </param>
+/// <param name="write"> 1 if the access is a store, 0 if it is a load or fetch. </param>
+/// <param name="accessPc"> The address of the instruction that made the access. </param>
+inline void push_cache_access(cacheAccessQueue* queue, uint32_t address, uint8_t size, uint8_t write, uint32_t accessPc)
+{
+	uint32_t tail = queue->tail.load(std::memory_order_relaxed);
+	while (tail - queue->cachedHead >= CACHE_ACCESS_QUEUE_SIZE)
+	{
+		queue->cachedHead = queue->head.load(std::memory_order_acquire);
+		if (tail - queue->cachedHead >= CACHE_ACCESS_QUEUE_SIZE)
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	cacheAccessRecord* record = &queue->records[tail & (CACHE_ACCESS_QUEUE_SIZE - 1)];
+	record->address = address;
+	record->pc = accessPc;
+	record->size = size;
+	record->write = write;
+	queue->tail.store(tail + 1, std::memory_order_release);
+
+	// there is no fence between publishing the record and this check, to keep pushes cheap
+	// so a helper that goes to sleep at the same moment can miss the wake up, and only notices the record when its sleep times out
+	if (queue->sleeping.load(std::memory_order_relaxed))
+	{
+		wake_cache_helper(queue);
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,161 @@
+#include "csr.h"
+#include "machine.h"
+
+/// <summary>
+/// Reads a control and status register. Only the counter CSRs (Zicntr and Zihpm) are implemented, any other CSR reads as 0.
+/// </summary>
+/// <param name="machine"> The machine the counters belong to. </param>
+/// <param name="csr"> The 12 bit address of the CSR to read. </param>
+/// <returns> The value of the CSR. </returns>
+uint32_t read_csr(Machine* machine, uint16_t csr)
+{
+	if (csr >= 0xc00 && csr <= 0xc1f)
+	{
+		// cycle, time, instret, hpmcounter3 to hpmcounter31 (lower 32 bits)
+		return (uint32_t)read_counter(machine, csr & 0x1f);
+	}
+	else if (csr >= 0xc80 && csr <= 0xc9f)
+	{
+		// cycleh, timeh, instreth, hpmcounter3h to hpmcounter31h (upper 32 bits)
+		return (uint32_t)(read_counter(machine, csr & 0x1f) >> 32);
+	}
+	else if (csr >= 0xb00 && csr <= 0xb1f && csr != 0xb01)
+	{
+		// mcycle, minstret, mhpmcounter3 to mhpmcounter31 (lower 32 bits)
+		return (uint32_t)read_counter(machine, csr & 0x1f);
+	}
+	else if (csr >= 0xb80 && csr <= 0xb9f && csr != 0xb81)
+	{
+		// mcycleh, minstreth, mhpmcounter3h to mhpmcounter31h (upper 32 bits)
+		return (uint32_t)(read_counter(machine, csr & 0x1f) >> 32);
+	}
+	else if (csr >= 0x323 && csr <= 0x33f)
+	{
+		// mhpmevent3 to mhpmevent31
+		return machine->hpmCounters[csr & 0x1f].event;
+	}
+	return 0;
+}
+
+/// <summary>
+/// Writes to a control and status register. Only the machine level counters and event selectors are writable, writes to anything else are ignored.
+/// </summary>
+/// <param name="machine"> The machine the counters belong to. </param>
+/// <param name="csr"> The 12 bit address of the CSR to write to. </param>
+/// <param name="value"> The value to write into the CSR. </param>
+void write_csr(Machine* machine, uint16_t csr, uint32_t value)
+{
+	if (csr >= 0xb00 && csr <= 0xb1f && csr != 0xb01)
+	{
+		// mcycle, minstret, mhpmcounter3 to mhpmcounter31 (lower 32 bits)
+		uint8_t counter = csr & 0x1f;
+		write_counter(machine, counter, (read_counter(machine, counter) & 0xffffffff00000000) | value);
+	}
+	else if (csr >= 0xb80 && csr <= 0xb9f && csr != 0xb81)
+	{
+		// mcycleh, minstreth, mhpmcounter3h to mhpmcounter31h (upper 32 bits)
+		uint8_t counter = csr & 0x1f;
+		write_counter(machine, counter, (read_counter(machine, counter) & 0x00000000ffffffff) | ((uint64_t)value << 32));
+	}
+	else if (csr >= 0x323 && csr <= 0x33f)
+	{
+		// mhpmevent3 to mhpmevent31
+		// unknown events count nothing, and the counter keeps its current value across the change
+		uint8_t counter = csr & 0x1f;
+		uint64_t currentValue = read_counter(machine, counter);
+		machine->hpmCounters[counter].event = value < PERF_EVENT_COUNT ? value : (uint32_t)PERF_EVENT_NONE;
+		write_counter(machine, counter, currentValue);
+	}
+}
+
+
+
+
+
+/// <summary>
+/// Works out the current value of a counter from the running totals.
+/// There is no pipeline model, so every instruction takes 1 cycle and cycle always moves with instret.
+/// </summary>
+/// <param name="machine"> The machine the counters belong to. </param>
+/// <param name="counter"> The counter number, 0 = cycle, 1 = time, 2 = instret, 3 to 31 = hpmcounter. </param>
+/// <returns> The 64 bit value of the counter. </returns>
+uint64_t read_counter(Machine* machine, uint8_t counter)
+{
+	if (counter == 0)
+	{
+		return machine->instructionsRetired - machine->cycleBase;
+	}
+	else if (counter == 1)
+	{
+		return read_time(machine);
+	}
+	else if (counter == 2)
+	{
+		return machine->instructionsRetired - machine->instretBase;
+	}
+	hpmCounter* hpm = &machine->hpmCounters[counter];
+	return read_event(machine, hpm->event) - hpm->base;
+}
+
+/// <summary>
+/// Sets a counter to the given value by moving its base, so that later reads count up from the new value.
+/// </summary>
+/// <param name="machine"> The machine the counters belong to. </param>
+/// <param name="counter"> The counter number, 0 = cycle, 1 = time, 2 = instret, 3 to 31 = hpmcounter. Time cannot be written. </param>
+/// <param name="value"> The value the counter should hold. </param>
+void write_counter(Machine* machine, uint8_t counter, uint64_t value)
+{
+	if (counter == 0)
+	{
+		machine->cycleBase = machine->instructionsRetired - value;
+	}
+	else if (counter == 2)
+	{
+		machine->instretBase = machine->instructionsRetired - value;
+	}
+	else if (counter >= 3)
+	{
+		hpmCounter* hpm = &machine->hpmCounters[counter];
+		hpm->base = read_event(machine, hpm->event) - value;
+	}
+}
+
+/// <summary>
+/// Reads the wall clock time since the machine was created, for the time CSR. It ticks at 1MHz.
+/// </summary>
+/// <param name="machine"> The machine the counters belong to. </param>
+/// <returns> The number of microseconds since the machine was created. </returns>
+uint64_t read_time(Machine* machine)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - machine->bootTime).count();
+}
+
+/// <summary>
+/// Reads the running total for an event, from wherever that event is counted.
+/// </summary>
+/// <param name="machine"> The machine the counters belong to. </param>
+/// <param name="event"> The event number, as written into mhpmevent. </param>
+/// <returns> The number of times the event has happened since the machine was created. </returns>
+uint64_t read_event(Machine* machine, uint32_t event)
+{
+	if (event >= PERF_EVENT_L1_PROGRAM_HIT && event <= PERF_EVENT_L1_DATA_WRITEBACK)
+	{
+		// the cache events are counted by the helper threads in decoupled mode, so let them catch up first
+		if (machine->cacheMode == CACHE_MODE_DECOUPLED)
+		{
+			wait_for_cache_simulation(machine);
+		}
+		l1CacheStats* stats = (event >= PERF_EVENT_L1_DATA_HIT) ? &machine->l1Data.stats : &machine->l1Program.stats;
+		uint32_t statistic = (event - PERF_EVENT_L1_PROGRAM_HIT) % 3;
+		if (statistic == 0)
+		{
+			return stats->hits;
+		}
+		else if (statistic == 1)
+		{
+			return stats->misses;
+		}
+		return stats->writebacks;
+	}
+	return machine->perfEvents[event];
+}
\ No newline at end of file
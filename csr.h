@@ -0,0 +1,47 @@
+#ifndef CSR_H
+#define CSR_H
+
+#include <stdint.h>
+
+/*
+events that can be counted by the programmable hpmcounters
+the event number is the value written into the matching mhpmevent CSR
+*/
+enum perfEvent
+{
+	PERF_EVENT_NONE = 0,
+	PERF_EVENT_L1_PROGRAM_HIT = 1,
+	PERF_EVENT_L1_PROGRAM_MISS = 2,
+	PERF_EVENT_L1_PROGRAM_WRITEBACK = 3,
+	PERF_EVENT_L1_DATA_HIT = 4,
+	PERF_EVENT_L1_DATA_MISS = 5,
+	PERF_EVENT_L1_DATA_WRITEBACK = 6,
+	PERF_EVENT_BRANCH_TAKEN = 7,
+	PERF_EVENT_LOAD = 8,
+	PERF_EVENT_STORE = 9,
+	PERF_EVENT_COUNT = 10
+};
+
+struct hpmCounter
+{
+	uint32_t event;
+	uint64_t base;
+};
+
+/*
+counters are never incremented directly, each one is derived from a free running total when it is read:
+counter value = total - base
+writing a counter only moves its base, so the hot paths only ever do a single increment
+*/
+
+struct Machine;
+
+uint32_t read_csr(Machine* machine, uint16_t csr);
+void write_csr(Machine* machine, uint16_t csr, uint32_t value);
+
+uint64_t read_counter(Machine* machine, uint8_t counter);
+void write_counter(Machine* machine, uint8_t counter, uint64_t value);
+uint64_t read_time(Machine* machine);
+uint64_t read_event(Machine* machine, uint32_t event);
+
+#endif
\ No newline at end of file
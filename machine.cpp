@@ -0,0 +1,236 @@
+#include "machine.h"
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+/// <summary>
+/// Makes a new machine, with its RAM, caches and registers all cleared and pc at 0.
+/// </summary>
+/// <returns> The new machine, or NULL if there was not enough memory for it. </returns>
+Machine* create_machine()
+{
+	// calloc lets the host hand out zeroed pages as they are first touched, instead of clearing all of RAM up front
+	uint8_t* ram = (uint8_t*)calloc(1, RAM_SIZE);
+	if (ram == NULL)
+	{
+		return NULL;
+	}
+
+	uint8_t* dirty = (uint8_t*)calloc(RAM_PAGES, sizeof(uint8_t));
+	uint32_t* pages = (uint32_t*)malloc(RAM_PAGES * sizeof(uint32_t));
+	Machine* machine = new (std::nothrow) Machine();
+	if (dirty == NULL || pages == NULL || machine == NULL)
+	{
+		free(ram);
+		free(dirty);
+		free(pages);
+		delete machine;
+		return NULL;
+	}
+
+	machine->ram = ram;
+	machine->dirtyPages.dirty = dirty;
+	machine->dirtyPages.pages = pages;
+	machine->l1Data.ram = ram;
+	machine->l1Data.dirtyPages = &machine->dirtyPages;
+	machine->l1Program.ram = ram;
+	machine->l1Program.dirtyPages = &machine->dirtyPages;
+	machine->l1Data.prefetcher.degree = 1;
+	machine->l1Program.prefetcher.degree = 1;
+	machine->cacheMode = CACHE_MODE_INLINE;
+	machine->bootTime = std::chrono::steady_clock::now();
+	return machine;
+}
+
+/// <summary>
+/// Stops any helper threads a machine has, and frees it.
+/// </summary>
+/// <param name="machine"> The machine to destroy. </param>
+void destroy_machine(Machine* machine)
+{
+	if (machine == NULL)
+	{
+		return;
+	}
+	stop_cache_simulation(machine);
+	free(machine->ram);
+	free(machine->dirtyPages.dirty);
+	free(machine->dirtyPages.pages);
+	delete machine;
+}
+
+/// <summary>
+/// Makes a new machine in the same state as an existing one. Only the pages of RAM the existing machine has written to are copied, so this is much cheaper than booting again.
+/// The new machine's dirty pages are cleared, so resetting it back to the snapshot later only copies what it has written since.
+/// </summary>
+/// <param name="snapshot"> The machine to copy. It must not be running, and must be in inline cache mode. </param>
+/// <returns> The new machine, or NULL if there was not enough memory for it. </returns>
+Machine* clone_machine(Machine* snapshot)
+{
+	Machine* machine = create_machine();
+	if (machine == NULL)
+	{
+		return NULL;
+	}
+
+	// every page the snapshot has written to differs from the new machine's empty RAM, so reset it as if it had written to them too
+	for (uint32_t i = 0; i < snapshot->dirtyPages.count; i++)
+	{
+		mark_page_dirty(&machine->dirtyPages, snapshot->dirtyPages.pages[i] * RAM_PAGE_SIZE);
+	}
+	reset_machine(machine, snapshot);
+	return machine;
+}
+
+/// <summary>
+/// Puts a machine back into the state of a snapshot it was cloned from, ready to run again.
+/// Only the pages of RAM written to since the last reset are copied back, along with the registers, caches and counters.
+/// </summary>
+/// <param name="machine"> The machine to reset. It must not be running, and must be in inline cache mode. </param>
+/// <param name="snapshot"> The machine it was cloned from, which must not have run since. </param>
+void reset_machine(Machine* machine, Machine* snapshot)
+{
+	dirtyPageTracker* tracker = &machine->dirtyPages;
+	for (uint32_t i = 0; i < tracker->count; i++)
+	{
+		uint32_t page = tracker->pages[i];
+		memcpy(&machine->ram[page * RAM_PAGE_SIZE], &snapshot->ram[page * RAM_PAGE_SIZE], RAM_PAGE_SIZE);
+		tracker->dirty[page] = 0;
+	}
+	tracker->count = 0;
+
+	machine->pc = snapshot->pc;
+	memcpy(machine->registers, snapshot->registers, sizeof(machine->registers));
+
+	// the caches hold dirty lines that are not in RAM yet, so they have to be copied whole, then pointed back at this machine's RAM
+	machine->l1Data = snapshot->l1Data;
+	machine->l1Data.ram = machine->ram;
+	machine->l1Data.dirtyPages = tracker;
+	machine->l1Program = snapshot->l1Program;
+	machine->l1Program.ram = machine->ram;
+	machine->l1Program.dirtyPages = tracker;
+
+	machine->instructionsRetired = snapshot->instructionsRetired;
+	memcpy(machine->perfEvents, snapshot->perfEvents, sizeof(machine->perfEvents));
+	machine->cycleBase = snapshot->cycleBase;
+	machine->instretBase = snapshot->instretBase;
+	memcpy(machine->hpmCounters, snapshot->hpmCounters, sizeof(machine->hpmCounters));
+}
+
+
+
+
+
+/// <summary>
+/// Copies all 32 registers out of a machine.
+/// </summary>
+/// <param name="machine"> The machine to read from. </param>
+/// <param name="output"> Where to put the registers, x0 first. Must have room for 32. </param>
+void read_registers(Machine* machine, int32_t* output)
+{
+	memcpy(output, machine->registers, sizeof(machine->registers));
+}
+
+/// <summary>
+/// Copies all 32 registers into a machine.
+/// </summary>
+/// <param name="machine"> The machine to write to. </param>
+/// <param name="input"> The new register values, x0 first. Must hold 32. </param>
+void write_registers(Machine* machine, const int32_t* input)
+{
+	memcpy(machine->registers, input, sizeof(machine->registers));
+}
+
+/// <summary>
+/// Copies a block of guest memory out of a machine, as the guest would see it. Dirty lines still in the data cache or its write buffer are read from there.
+/// The caches are not touched, so this does not change any statistics. It must not be called while the machine is running.
+/// </summary>
+/// <param name="machine"> The machine to read from. </param>
+/// <param name="address"> The guest address of the first byte to read. </param>
+/// <param name="output"> Where to put the bytes. </param>
+/// <param name="length"> The number of bytes to read. </param>
+/// <returns> 1 if the bytes were read, 0 if the block does not fit in RAM. </returns>
+uint8_t read_guest_memory(Machine* machine, uint32_t address, uint8_t* output, uint32_t length)
+{
+	if ((uint64_t)address + length > RAM_SIZE)
+	{
+		return 0;
+	}
+
+	while (length > 0)
+	{
+		uint32_t lineAddress = address & 0xffffffc0;
+		uint32_t offset = address & 0x3f;
+		uint32_t chunk = 64 - offset;
+		if (chunk > length)
+		{
+			chunk = length;
+		}
+
+		// the data cache has the newest copy of a line, then the write buffer, then RAM
+		uint8_t* line = find_cached_line(&machine->l1Data, lineAddress);
+		if (line == NULL)
+		{
+			line = find_buffered_line(&machine->l1Data, lineAddress);
+		}
+		if (line == NULL)
+		{
+			line = &machine->ram[lineAddress];
+		}
+		memcpy(output, line + offset, chunk);
+
+		address += chunk;
+		output += chunk;
+		length -= chunk;
+	}
+	return 1;
+}
+
+/// <summary>
+/// Copies a block into guest memory, updating every copy of the lines it covers so that both caches see it straight away.
+/// The caches are not touched otherwise, so this does not change any statistics. It must not be called while the machine is running.
+/// </summary>
+/// <param name="machine"> The machine to write to. </param>
+/// <param name="address"> The guest address of the first byte to write. </param>
+/// <param name="input"> The bytes to write. </param>
+/// <param name="length"> The number of bytes to write. </param>
+/// <returns> 1 if the bytes were written, 0 if the block does not fit in RAM. </returns>
+uint8_t write_guest_memory(Machine* machine, uint32_t address, const uint8_t* input, uint32_t length)
+{
+	if ((uint64_t)address + length > RAM_SIZE)
+	{
+		return 0;
+	}
+
+	while (length > 0)
+	{
+		uint32_t lineAddress = address & 0xffffffc0;
+		uint32_t offset = address & 0x3f;
+		uint32_t chunk = 64 - offset;
+		if (chunk > length)
+		{
+			chunk = length;
+		}
+
+		memcpy(&machine->ram[address], input, chunk);
+		mark_page_dirty(&machine->dirtyPages, address);
+
+		uint8_t* copies[4];
+		copies[0] = find_cached_line(&machine->l1Data, lineAddress);
+		copies[1] = find_buffered_line(&machine->l1Data, lineAddress);
+		copies[2] = find_cached_line(&machine->l1Program, lineAddress);
+		copies[3] = find_buffered_line(&machine->l1Program, lineAddress);
+		for (uint8_t copy = 0; copy < 4; copy++)
+		{
+			if (copies[copy] != NULL)
+			{
+				memcpy(copies[copy] + offset, input, chunk);
+			}
+		}
+
+		address += chunk;
+		input += chunk;
+		length -= chunk;
+	}
+	return 1;
+}
\ No newline at end of file
@@ -0,0 +1,69 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "cache.h"
+#include "cachesim.h"
+#include "csr.h"
+
+enum stopReason
+{
+	STOP_INSTRUCTION_LIMIT = 0, // ran the number of instructions asked for
+	STOP_PC_REACHED = 1, // pc got to the address given to run_until(), the instruction there has not run yet
+	STOP_ECALL = 2, // the guest ran ecall, pc is already past it
+	STOP_EBREAK = 3, // the guest ran ebreak, pc is already past it
+	STOP_ACCESS_FAULT = 4 // the guest fetched, loaded or stored outside of RAM, pc is still on that instruction and it has not run
+};
+
+/*
+one complete emulated computer
+nothing is shared between machines, so any number of them can exist and run at the same time on different host threads
+*/
+struct Machine
+{
+	// CPU
+	uint32_t pc;
+	int32_t registers[32];
+
+	// memory
+	uint8_t* ram; // RAM_SIZE bytes
+	l1Cache l1Data;
+	l1Cache l1Program;
+	dirtyPageTracker dirtyPages; // the pages of RAM written to since the last reset_machine()
+
+	// counters, see csr.h
+	uint64_t instructionsRetired;
+	uint64_t perfEvents[PERF_EVENT_COUNT]; // only the events counted by the CPU thread, the cache events come from the cache statistics
+	uint64_t cycleBase;
+	uint64_t instretBase;
+	hpmCounter hpmCounters[32]; // only 3 to 31 are used, 0 to 2 are cycle, time and instret
+	std::chrono::steady_clock::time_point bootTime;
+
+	// decoupled cache simulation, see cachesim.h
+	uint8_t cacheMode;
+	std::atomic<uint8_t> helpersRunning;
+	std::thread programCacheHelper;
+	std::thread dataCacheHelper;
+	cacheAccessQueue programAccessQueue;
+	cacheAccessQueue dataAccessQueue;
+};
+
+Machine* create_machine();
+void destroy_machine(Machine* machine);
+Machine* clone_machine(Machine* snapshot);
+void reset_machine(Machine* machine, Machine* snapshot);
+
+stopReason run(Machine* machine, uint64_t maxInstructions);
+stopReason run_until(Machine* machine, uint32_t stopPc, uint64_t maxInstructions);
+
+void read_registers(Machine* machine, int32_t* output);
+void write_registers(Machine* machine, const int32_t* input);
+
+uint8_t read_guest_memory(Machine* machine, uint32_t address, uint8_t* output, uint32_t length);
+uint8_t write_guest_memory(Machine* machine, uint32_t address, const uint8_t* input, uint32_t length);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,118 @@
+#include "prefetch.h"
+#include "cache.h"
+
+/// <summary>
+/// Shows the prefetcher one demand access, and lets it fetch lines ahead of it. This is called once per load, store or fetch, after get_cache_line() has been called for every byte of it.
+/// </summary>
+/// <param name="cache"> The cache that was accessed, which is also the one to prefetch into. </param>
+/// <param name="address"> The address of the first byte accessed. </param>
+/// <param name="accessPc"> The address of the instruction that made the access. </param>
+void train_prefetcher(l1Cache* cache, uint32_t address, uint32_t accessPc)
+{
+	l1Prefetcher* prefetcher = &cache->prefetcher;
+	uint8_t triggered = prefetcher->triggered;
+	prefetcher->triggered = 0;
+
+	uint32_t line = address >> 6;
+
+	if (prefetcher->mode == PREFETCH_NEXT_LINE)
+	{
+		if (triggered)
+		{
+			for (uint8_t ahead = 1; ahead <= prefetcher->degree; ahead++)
+			{
+				prefetch_cache_line(cache, (line + ahead) << 6);
+			}
+		}
+	}
+	else if (prefetcher->mode == PREFETCH_STRIDE)
+	{
+		// the table is indexed by the instruction address, as instructions are 4 byte aligned the bottom 2 bits are skipped
+		l1StrideEntry* entry = &prefetcher->strideTable[(accessPc >> 2) & (PREFETCH_STRIDE_ENTRIES - 1)];
+		if (entry->pc != accessPc)
+		{
+			entry->pc = accessPc;
+			entry->lastAddress = address;
+			entry->stride = 0;
+			entry->confidence = 0;
+			return;
+		}
+
+		int32_t stride = (int32_t)(address - entry->lastAddress);
+		entry->lastAddress = address;
+		if (stride != 0 && stride == entry->stride)
+		{
+			if (entry->confidence < 3)
+			{
+				entry->confidence++;
+			}
+		}
+		else
+		{
+			entry->stride = stride;
+			entry->confidence = 0;
+		}
+
+		// only fetch ahead once the same stride has been seen twice in a row
+		if (entry->confidence >= 2)
+		{
+			for (uint8_t ahead = 1; ahead <= prefetcher->degree; ahead++)
+			{
+				uint32_t prefetchAddress = address + (uint32_t)stride * ahead; // unsigned, so a large stride wraps instead of overflowing
+				if ((prefetchAddress >> 6) != line)
+				{
+					prefetch_cache_line(cache, prefetchAddress);
+				}
+			}
+		}
+	}
+	else if (prefetcher->mode == PREFETCH_STREAM)
+	{
+		if (!triggered)
+		{
+			return;
+		}
+
+		for (uint8_t stream = 0; stream < PREFETCH_STREAMS; stream++)
+		{
+			l1StreamEntry* entry = &prefetcher->streams[stream];
+			int32_t distance = (int32_t)(line - entry->lastLine);
+			if (distance == 0)
+			{
+				// already being tracked
+				return;
+			}
+
+			// a new stream can go either way, an established one has to keep going the same way and stay within the lines it has fetched ahead
+			uint8_t matches = 0;
+			if (entry->direction == 0)
+			{
+				matches = (distance == 1 || distance == -1);
+			}
+			else
+			{
+				matches = (distance * entry->direction >= 1 && distance * entry->direction <= prefetcher->degree);
+			}
+
+			if (matches)
+			{
+				if (entry->direction == 0)
+				{
+					entry->direction = distance > 0 ? 1 : -1;
+				}
+				entry->lastLine = line;
+				for (uint8_t ahead = 1; ahead <= prefetcher->degree; ahead++)
+				{
+					prefetch_cache_line(cache, (line + entry->direction * ahead) << 6);
+				}
+				return;
+			}
+		}
+
+		// no stream continues from here, so start a new one
+		l1StreamEntry* entry = &prefetcher->streams[prefetcher->nextStream];
+		entry->lastLine = line;
+		entry->direction = 0;
+		prefetcher->nextStream = (prefetcher->nextStream + 1) % PREFETCH_STREAMS;
+	}
+}
\ No newline at end of file
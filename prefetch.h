@@ -0,0 +1,46 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdint.h>
+
+#define PREFETCH_MAX_DEGREE 8
+#define PREFETCH_STRIDE_ENTRIES 64
+#define PREFETCH_STREAMS 8
+
+enum prefetcherMode
+{
+	PREFETCH_NONE = 0,
+	PREFETCH_NEXT_LINE = 1, // fetch the lines after a miss
+	PREFETCH_STRIDE = 2, // remember the last address and stride of each load/store instruction, and fetch ahead once a stride repeats
+	PREFETCH_STREAM = 3 // spot misses to neighbouring lines, and run ahead of them in the same direction
+};
+
+struct l1StrideEntry
+{
+	uint32_t pc;
+	uint32_t lastAddress;
+	int32_t stride;
+	uint8_t confidence;
+};
+
+struct l1StreamEntry
+{
+	uint32_t lastLine;
+	int8_t direction; // 0 until a second miss shows which way the stream is going
+};
+
+struct l1Prefetcher
+{
+	uint8_t mode;
+	uint8_t degree; // how many lines to fetch ahead each time
+	uint8_t triggered; // set by get_cache_line() on a miss, or on the first hit to a prefetched line
+	uint8_t nextStream; // the stream to replace next, round robin
+	l1StrideEntry strideTable[PREFETCH_STRIDE_ENTRIES];
+	l1StreamEntry streams[PREFETCH_STREAMS];
+};
+
+struct l1Cache;
+
+void train_prefetcher(l1Cache* cache, uint32_t address, uint32_t accessPc);
+
+#endif
\ No newline at end of file
@@ -1,53 +1,122 @@
 #include "running.h"
-#include "cache.h"
-#include <stdio.h>
-
-uint32_t pc = 0;
-int32_t registers[32];
+#include "machine.h"
 
 /// <summary>
-/// The execution is in this function for the majority of the time. It loops from the end of the boot to shutdown.
-/// It acts as the CPU, which means it fetches instructions from memory, decodes them and executes them.
+/// The execution is in this function for the majority of the time.
+/// It acts as the CPU, which means it fetches instructions from memory, decodes them and executes them, until one of the stop conditions is met.
+/// The retired count is kept in a local, as guest stores through ram could otherwise alias it and force a reload every instruction. It is written back before CSR instructions, which can read it, and on return.
+/// Each instruction still pays for the limit compare, the stopPc compare when checkPc is set, and a bounds check on pc.
 /// </summary>
-void run_cpu()
+/// <param name="machine"> The machine to run. </param>
+/// <param name="maxInstructions"> The most instructions to run before returning. </param>
+/// <param name="stopPc"> The address to stop at, if checkPc is set. </param>
+/// <param name="checkPc"> 1 to stop when pc gets to stopPc, 0 to ignore it. </param>
+/// <returns> Why the machine stopped. </returns>
+inline stopReason run_cpu(Machine* machine, uint64_t maxInstructions, uint32_t stopPc, uint8_t checkPc)
 {
-	uint8_t shouldTerminate = 0;
-	registers[10] = 225;
-	registers[11] = 60;
-	while (shouldTerminate == 0)
+	uint64_t retired = machine->instructionsRetired;
+	uint64_t lastInstruction = retired + maxInstructions;
+	if (lastInstruction < maxInstructions)
+	{
+		// asked for more instructions than the counter can reach, so just run until another stop
+		lastInstruction = UINT64_MAX;
+	}
+
+	stopReason reason = STOP_INSTRUCTION_LIMIT;
+	while (retired < lastInstruction)
 	{
+		if (checkPc && machine->pc == stopPc)
+		{
+			reason = STOP_PC_REACHED;
+			break;
+		}
+
+		// an access fault is checked for up front, so a bad jump stops with pc on the address it jumped to
+		if (!address_in_ram(machine->pc, 4))
+		{
+			reason = STOP_ACCESS_FAULT;
+			break;
+		}
+
 		// running
-		uint32_t instruction = read_program_memory(pc);
-		pc += 4;
+		uint32_t instruction = read_program_memory(machine, machine->pc);
+		machine->pc += 4;
 
 		// Decode the CPU instruction. Refer to https://www.cs.sfu.ca/~ashriram/Courses/CS295/assets/notebooks/RISCV/RISCV_CARD.pdf for more info.
 		
 		uint8_t opcode = instruction & 0x7f;
+		uint8_t stop = 0;
 
 		switch (opcode)
 		{
 		case 0b0110011:
-			R_type(instruction); break;
+			R_type(machine, instruction); break;
 		case 0b0010011:
 		case 0b0000011:
 		case 0b1100111:
+			stop = I_type(machine, instruction); break;
 		case 0b1110011:
-			I_type(instruction); break;
+			// the CSR instructions read and write the counters, which are worked out from the retired count
+			machine->instructionsRetired = retired;
+			stop = I_type(machine, instruction);
+			retired = machine->instructionsRetired;
+			break;
 		case 0b0100011:
-			S_type(instruction); break;
+			stop = S_type(machine, instruction); break;
 		case 0b1100011:
-			B_type(instruction); break;
+			B_type(machine, instruction); break;
 		case 0b0110111:
 		case 0b0010111:
-			U_type(instruction); break;
+			U_type(machine, instruction); break;
 		case 0b1101111:
-			J_type(instruction); break;
+			J_type(machine, instruction); break;
+		}
+
+		if (stop == STOP_ACCESS_FAULT)
+		{
+			// the faulting load or store did nothing, so leave pc on it and don't retire it
+			machine->pc -= 4;
+			reason = STOP_ACCESS_FAULT;
+			break;
+		}
+
+		retired++;
+
+		if (stop)
+		{
+			reason = (stopReason)stop;
+			break;
 		}
 	}
-	return;
+
+	machine->instructionsRetired = retired;
+	return reason;
+}
+
+/// <summary>
+/// Runs the machine for up to the given number of instructions.
+/// </summary>
+/// <param name="machine"> The machine to run. </param>
+/// <param name="maxInstructions"> The most instructions to run before returning. </param>
+/// <returns> Why the machine stopped. </returns>
+stopReason run(Machine* machine, uint64_t maxInstructions)
+{
+	return run_cpu(machine, maxInstructions, 0, 0);
 }
 
-inline void R_type(uint32_t instruction)
+/// <summary>
+/// Runs the machine until pc gets to the given address, or it has run the given number of instructions.
+/// </summary>
+/// <param name="machine"> The machine to run. </param>
+/// <param name="stopPc"> The address to stop at. The instruction there is not run. </param>
+/// <param name="maxInstructions"> The most instructions to run before returning. </param>
+/// <returns> Why the machine stopped. </returns>
+stopReason run_until(Machine* machine, uint32_t stopPc, uint64_t maxInstructions)
+{
+	return run_cpu(machine, maxInstructions, stopPc, 1);
+}
+
+inline void R_type(Machine* machine, uint32_t instruction)
 {
 	uint8_t rd = instruction >> 7 & 0x01f;
 	uint8_t funct3 = instruction >> 12 & 0x07;
@@ -58,70 +127,70 @@ inline void R_type(uint32_t instruction)
 	if (funct3 == 0x0 && funct7 == 0x00)
 	{
 		// add (ADD)
-		registers[rd] = registers[rs1] + registers[rs2];
+		machine->registers[rd] = machine->registers[rs1] + machine->registers[rs2];
 	}
 	else if (funct3 == 0x0 && funct7 == 0x20)
 	{
 		// sub (SUB)
-		registers[rd] = registers[rs1] - registers[rs2];
+		machine->registers[rd] = machine->registers[rs1] - machine->registers[rs2];
 	}
 	else if (funct3 == 0x4 && funct7 == 0x00)
 	{
 		// xor (XOR)
-		registers[rd] = registers[rs1] ^ registers[rs2];
+		machine->registers[rd] = machine->registers[rs1] ^ machine->registers[rs2];
 	}
 	else if (funct3 == 0x6 && funct7 == 0x00)
 	{
 		// or (OR)
-		registers[rd] = registers[rs1] | registers[rs2];
+		machine->registers[rd] = machine->registers[rs1] | machine->registers[rs2];
 	}
 	else if (funct3 == 0x7 && funct7 == 0x00)
 	{
 		// and (AND)
-		registers[rd] = registers[rs1] & registers[rs2];
+		machine->registers[rd] = machine->registers[rs1] & machine->registers[rs2];
 	}
 	else if (funct3 == 0x1 && funct7 == 0x00)
 	{
 		// sll (Shift Left Logical)
-		registers[rd] = registers[rs1] << registers[rs2];
+		machine->registers[rd] = machine->registers[rs1] << machine->registers[rs2];
 	}
 	else if (funct3 == 0x5 && funct7 == 0x00)
 	{
 		// srl (Shift Right Logical)
-		registers[rd] = (uint32_t)registers[rs1] >> registers[rs2];
+		machine->registers[rd] = (uint32_t)machine->registers[rs1] >> machine->registers[rs2];
 	}
 	else if (funct3 == 0x5 && funct7 == 0x20)
 	{
 		// sra (Shift Right Arithmetic)
-		registers[rd] = (int32_t)registers[rs1] >> registers[rs2];
+		machine->registers[rd] = (int32_t)machine->registers[rs1] >> machine->registers[rs2];
 	}
 	else if (funct3 == 0x2 && funct7 == 0x00)
 	{
 		// slt (Set Less Than)
-		if ((int32_t)registers[rs1] < (int32_t)registers[rs2])
+		if ((int32_t)machine->registers[rs1] < (int32_t)machine->registers[rs2])
 		{
-			registers[rd] = 1;
+			machine->registers[rd] = 1;
 		}
 		else
 		{
-			registers[rd] = 0;
+			machine->registers[rd] = 0;
 		}
 	}
 	else if (funct3 == 0x3 && funct7 == 0x00)
 	{
 		// sltu (Set Less Than (Unsigned))
-		if ((uint32_t)registers[rs1] < (uint32_t)registers[rs2])
+		if ((uint32_t)machine->registers[rs1] < (uint32_t)machine->registers[rs2])
 		{
-			registers[rd] = 1;
+			machine->registers[rd] = 1;
 		}
 		else
 		{
-			registers[rd] = 0;
+			machine->registers[rd] = 0;
 		}
 	}
 }
 
-inline void I_type(uint32_t instruction)
+inline uint8_t I_type(Machine* machine, uint32_t instruction)
 {
 	uint8_t opcode = instruction & 0x7f;
 	uint8_t rd = instruction >> 7 & 0x1f;
@@ -134,45 +203,45 @@ inline void I_type(uint32_t instruction)
 		if (funct3 == 0x0)
 		{
 			// addi (ADD Immediate)
-			registers[rd] = registers[rs1] + imm;
+			machine->registers[rd] = machine->registers[rs1] + imm;
 		}
 		else if (funct3 == 0x4)
 		{
 			// xori (XOR Immediate)
-			registers[rd] = registers[rs1] ^ imm;
+			machine->registers[rd] = machine->registers[rs1] ^ imm;
 		}
 		else if (funct3 == 0x6)
 		{
 			// ori (OR Immediate)
-			registers[rd] = registers[rs1] | imm;
+			machine->registers[rd] = machine->registers[rs1] | imm;
 		}
 		else if (funct3 == 0x7)
 		{
 			// andi (AND Immediate)
-			registers[rd] = registers[rs1] & imm;
+			machine->registers[rd] = machine->registers[rs1] & imm;
 		}
 		else if (funct3 == 0x1)
 		{
 			//slli (Shift Left Logical Imm)
 			imm &= 0x001f;
-			registers[rd] = registers[rs1] << imm;
+			machine->registers[rd] = machine->registers[rs1] << imm;
 		}
 		else if (funct3 == 0x5 && imm == 0x0000)
 		{
 			// srli (Shift Right Logical Imm)
 			imm &= 0x001f;
-			registers[rd] = (uint32_t)registers[rd] >> imm;
+			machine->registers[rd] = (uint32_t)machine->registers[rd] >> imm;
 		}
 		else if (funct3 == 0x5 && imm == 0x0400)
 		{
 			// srai (Shift Right Arith Imm)
 			imm &= 0x001f;
-			registers[rd] = (int32_t)registers[rd] >> imm;
+			machine->registers[rd] = (int32_t)machine->registers[rd] >> imm;
 		}
 		else if (funct3 == 0x2)
 		{
 			// slti (Set Less Than Imm)
-			if ((int32_t)registers[rd] < (int32_t)imm)
+			if ((int32_t)machine->registers[rd] < (int32_t)imm)
 			{
 				rd = 1;
 			}
@@ -184,7 +253,7 @@ inline void I_type(uint32_t instruction)
 		else if (funct3 == 0x3)
 		{
 			// sltiu (Set Less Than Imm (U))
-			if ((uint32_t)registers[rd] < (uint32_t)imm)
+			if ((uint32_t)machine->registers[rd] < (uint32_t)imm)
 			{
 				rd = 1;
 			}
@@ -196,30 +265,41 @@ inline void I_type(uint32_t instruction)
 	}
 	else if (opcode == 0b0000011)
 	{
+		// lb and lbu are 1 byte, lh and lhu are 2 bytes, and lw is 4 bytes
+		if (!address_in_ram((uint32_t)machine->registers[rs1] + imm, 1 << (funct3 & 0x3)))
+		{
+			return STOP_ACCESS_FAULT;
+		}
+
 		if (funct3 == 0x0)
 		{
 			// lb (Load Byte)
-			registers[rd] = (int32_t)read_memory_b((uint32_t)registers[rs1] + imm);
+			machine->perfEvents[PERF_EVENT_LOAD]++;
+			machine->registers[rd] = (int32_t)read_memory_b(machine, (uint32_t)machine->registers[rs1] + imm);
 		}
 		else if (funct3 == 0x1)
 		{
 			// lh (Load Half)
-			registers[rd] = (int32_t)read_memory_s((uint32_t)registers[rs1] + imm);
+			machine->perfEvents[PERF_EVENT_LOAD]++;
+			machine->registers[rd] = (int32_t)read_memory_s(machine, (uint32_t)machine->registers[rs1] + imm);
 		}
 		else if (funct3 == 0x2)
 		{
 			// lw (Load Word)
-			registers[rd] = (int32_t)read_memory_i((uint32_t)registers[rs1] + imm);
+			machine->perfEvents[PERF_EVENT_LOAD]++;
+			machine->registers[rd] = (int32_t)read_memory_i(machine, (uint32_t)machine->registers[rs1] + imm);
 		}
 		else if (funct3 == 0x4)
 		{
 			// lbu (Load Byte (U))
-			registers[rd] = (uint32_t)read_memory_b((uint32_t)registers[rs1] + imm);
+			machine->perfEvents[PERF_EVENT_LOAD]++;
+			machine->registers[rd] = (uint32_t)read_memory_b(machine, (uint32_t)machine->registers[rs1] + imm);
 		}
 		else if (funct3 == 0x5)
 		{
 			// lhu (Load Half (U))
-			registers[rd] = (uint32_t)read_memory_s((uint32_t)registers[rs1] + imm);
+			machine->perfEvents[PERF_EVENT_LOAD]++;
+			machine->registers[rd] = (uint32_t)read_memory_s(machine, (uint32_t)machine->registers[rs1] + imm);
 		}
 	}
 	else if (opcode == 0b1100111)
@@ -227,28 +307,65 @@ inline void I_type(uint32_t instruction)
 		if (funct3 == 0x0)
 		{
 			// jalr (Jump And Link Reg)
-			registers[rd] = pc + 4;
-			pc = registers[rs1] + imm;
+			machine->registers[rd] = machine->pc + 4;
+			machine->pc = machine->registers[rs1] + imm;
 		}
 	}
 	else if (opcode == 0b1110011)
 	{
 		if (funct3 == 0x0 && imm == 0x0)
 		{
-			printf("ecall\n");
 			// ecall (Environment Call)
-			// NOT YET IMPLEMENTED
+			// handed to whoever is running the machine
+			return STOP_ECALL;
 		}
 		else if (funct3 == 0x0 && imm == 0x1)
 		{
-			printf("ebreak\n");
 			// ebreak (Environment Break)
-			// NOT YET IMPLEMENTED
+			// handed to whoever is running the machine
+			return STOP_EBREAK;
+		}
+		else if (funct3 != 0x0 && funct3 != 0x4)
+		{
+			// csrrw, csrrs, csrrc, csrrwi, csrrsi, csrrci (Zicsr)
+			// the CSR address is the full 12 bit immediate, and for the immediate forms rs1 holds a 5 bit zero-extended value
+			uint16_t csr = instruction >> 20 & 0x0fff;
+			uint32_t source = (funct3 & 0x4) ? rs1 : (uint32_t)machine->registers[rs1];
+			uint8_t operation = funct3 & 0x3;
+
+			// csrrw(i) only reads the CSR if rd is not x0
+			uint32_t oldValue = 0;
+			if (operation != 0x1 || rd != 0)
+			{
+				oldValue = read_csr(machine, csr);
+			}
+
+			if (operation == 0x1)
+			{
+				// csrrw (CSR Read/Write)
+				write_csr(machine, csr, source);
+			}
+			else if (operation == 0x2 && rs1 != 0)
+			{
+				// csrrs (CSR Read and Set bits)
+				write_csr(machine, csr, oldValue | source);
+			}
+			else if (operation == 0x3 && rs1 != 0)
+			{
+				// csrrc (CSR Read and Clear bits)
+				write_csr(machine, csr, oldValue & ~source);
+			}
+
+			if (rd != 0)
+			{
+				machine->registers[rd] = oldValue;
+			}
 		}
 	}
+	return 0;
 }
 
-inline void S_type(uint32_t instruction)
+inline uint8_t S_type(Machine* machine, uint32_t instruction)
 {
 	uint8_t immLower = (instruction >> 7) & 0x01f;
 	uint8_t funct3 = (instruction >> 12) & 0x07;
@@ -257,24 +374,34 @@ inline void S_type(uint32_t instruction)
 	uint8_t immUpper = (instruction >> 25) & 0x7f;
 	uint16_t imm = (immUpper << 5) + immLower;
 
+	// sb is 1 byte, sh is 2 bytes, and sw is 4 bytes
+	if (!address_in_ram((uint32_t)machine->registers[rs1] + imm, 1 << (funct3 & 0x3)))
+	{
+		return STOP_ACCESS_FAULT;
+	}
+
 	if (funct3 == 0x0)
 	{
 		// sb (Store Byte)
-		write_memory_b((uint32_t)registers[rs1] + imm, (uint8_t)registers[rs2]);
+		machine->perfEvents[PERF_EVENT_STORE]++;
+		write_memory_b(machine, (uint32_t)machine->registers[rs1] + imm, (uint8_t)machine->registers[rs2]);
 	}
 	else if (funct3 == 0x1)
 	{
 		// sh (Store Half)
-		write_memory_s((uint32_t)registers[rs1] + imm, (uint16_t)registers[rs2]);
+		machine->perfEvents[PERF_EVENT_STORE]++;
+		write_memory_s(machine, (uint32_t)machine->registers[rs1] + imm, (uint16_t)machine->registers[rs2]);
 	}
 	else if (funct3 == 0x2)
 	{
 		// sw (Store Word)
-		write_memory_i((uint32_t)registers[rs1] + imm, (uint32_t)registers[rs2]);
+		machine->perfEvents[PERF_EVENT_STORE]++;
+		write_memory_i(machine, (uint32_t)machine->registers[rs1] + imm, (uint32_t)machine->registers[rs2]);
 	}
+	return 0;
 }
 
-inline void B_type(uint32_t instruction)
+inline void B_type(Machine* machine, uint32_t instruction)
 {
 	int32_t immediate = (instruction >> 7) & 0x1e; // imm [4:1]
 	immediate |= (instruction >> 20) & 0x7e0;		// imm [10:5]
@@ -295,60 +422,66 @@ inline void B_type(uint32_t instruction)
 	if (funct3 == 0x0)
 	{
 		// beq (Branch if equal)
-		if (registers[rs1] == registers[rs2])
+		if (machine->registers[rs1] == machine->registers[rs2])
 		{
-			pc -= 4;
-			pc += immediate;
+			machine->pc -= 4;
+			machine->pc += immediate;
+			machine->perfEvents[PERF_EVENT_BRANCH_TAKEN]++;
 		}
 	}
 	else if (funct3 == 0x1)
 	{
 		// bne (Branch if not equal to)
-		if (registers[rs1] != registers[rs2])
+		if (machine->registers[rs1] != machine->registers[rs2])
 		{
-			pc -= 4;
-			pc += immediate;
+			machine->pc -= 4;
+			machine->pc += immediate;
+			machine->perfEvents[PERF_EVENT_BRANCH_TAKEN]++;
 		}
 	}
 	else if (funct3 == 0x4)
 	{
 		// blt (Branch if less than)
-		if (registers[rs1] < registers[rs2])
+		if (machine->registers[rs1] < machine->registers[rs2])
 		{
-			pc -= 4;
-			pc += immediate;
+			machine->pc -= 4;
+			machine->pc += immediate;
+			machine->perfEvents[PERF_EVENT_BRANCH_TAKEN]++;
 		}
 	}
 	else if (funct3 == 0x5)
 	{
 		// bge (Branch if greater than or equal to)
-		if (registers[rs1] >= registers[rs2])
+		if (machine->registers[rs1] >= machine->registers[rs2])
 		{
-			pc -= 4;
-			pc += immediate;
+			machine->pc -= 4;
+			machine->pc += immediate;
+			machine->perfEvents[PERF_EVENT_BRANCH_TAKEN]++;
 		}
 	}
 	else if (funct3 == 0x6)
 	{
 		// bltu (Branch if less than (unsigned))
-		if ((uint32_t)registers[rs1] < (uint32_t)registers[rs2])
+		if ((uint32_t)machine->registers[rs1] < (uint32_t)machine->registers[rs2])
 		{
-			pc -= 4;
-			pc += immediate;
+			machine->pc -= 4;
+			machine->pc += immediate;
+			machine->perfEvents[PERF_EVENT_BRANCH_TAKEN]++;
 		}
 	}
 	else if (funct3 == 0x7)
 	{
 		// bgeu (Branch if greater than or equal to (unsigned))
-		if ((uint32_t)registers[rs1] >= (uint32_t)registers[rs2])
+		if ((uint32_t)machine->registers[rs1] >= (uint32_t)machine->registers[rs2])
 		{
-			pc -= 4;
-			pc += immediate;
+			machine->pc -= 4;
+			machine->pc += immediate;
+			machine->perfEvents[PERF_EVENT_BRANCH_TAKEN]++;
 		}
 	}
 }
 
-inline void U_type(uint32_t instruction)
+inline void U_type(Machine* machine, uint32_t instruction)
 {
 	uint32_t immediate = instruction & 0xfffff000;
 	uint8_t rd = (instruction >> 7) & 0x1f;
@@ -357,16 +490,16 @@ inline void U_type(uint32_t instruction)
 	if (opcode == 0b0110111)
 	{
 		// lui (Load upper immediate)
-		registers[rd] = immediate;
+		machine->registers[rd] = immediate;
 	}
 	else if (opcode == 0b0010111)
 	{
 		// auipc (Add upper immediate to PC)
-		registers[rd] = pc + immediate;
+		machine->registers[rd] = machine->pc + immediate;
 	}
 }
 
-inline void J_type(uint32_t instruction)
+inline void J_type(Machine* machine, uint32_t instruction)
 {
 	uint8_t opcode = instruction & 0x7f;
 	uint8_t rd = (instruction >> 7) & 0x1f;
@@ -376,6 +509,6 @@ inline void J_type(uint32_t instruction)
 	immediate |= (instruction >> 11) & 0x1fffff;
 
 	// jal (Jump And Link)
-	registers[rd] = pc + 4;
-	pc += immediate;
+	machine->registers[rd] = machine->pc + 4;
+	machine->pc += immediate;
 }
\ No newline at end of file
@@ -3,15 +3,13 @@
 
 #include <stdint.h>
 
-extern uint32_t pc;
-extern int32_t registers[32];
-
-void run_cpu();
-inline void R_type(uint32_t instruction);
-inline void I_type(uint32_t instruction);
-inline void S_type(uint32_t instruction);
-inline void B_type(uint32_t instruction);
-inline void U_type(uint32_t instruction);
-inline void J_type(uint32_t instruction);
+struct Machine;
+
+inline void R_type(Machine* machine, uint32_t instruction);
+inline uint8_t I_type(Machine* machine, uint32_t instruction); // returns a stopReason if the machine should stop, or 0 to carry on
+inline uint8_t S_type(Machine* machine, uint32_t instruction); // returns STOP_ACCESS_FAULT if the store is outside of RAM, or 0 to carry on
+inline void B_type(Machine* machine, uint32_t instruction);
+inline void U_type(Machine* machine, uint32_t instruction);
+inline void J_type(Machine* machine, uint32_t instruction);
 
 #endif
\ No newline at end of file
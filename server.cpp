@@ -0,0 +1,284 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "Ws2_32.lib")
+typedef SOCKET serverSocket;
+#define close_socket closesocket
+#else
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+typedef int serverSocket;
+#define INVALID_SOCKET -1
+#define close_socket close
+#endif
+
+/// <summary>
+/// Reads exactly the given number of bytes from a connection, waiting for as many packets as it takes.
+/// </summary>
+/// <param name="connection"> The connection to read from. </param>
+/// <param name="buffer"> Where to put the bytes. </param>
+/// <param name="length"> The number of bytes to read. </param>
+/// <returns> 1 if every byte was read, 0 if the connection closed or failed first. </returns>
+uint8_t receive_all(serverSocket connection, void* buffer, uint32_t length)
+{
+	char* next = (char*)buffer;
+	while (length > 0)
+	{
+		int received = recv(connection, next, (int)length, 0);
+		if (received <= 0)
+		{
+			return 0;
+		}
+		next += received;
+		length -= (uint32_t)received;
+	}
+	return 1;
+}
+
+/// <summary>
+/// Reads and throws away the given number of bytes from a connection, so the next request can be read after one that was too big to keep.
+/// </summary>
+/// <param name="connection"> The connection to read from. </param>
+/// <param name="length"> The number of bytes to throw away. </param>
+/// <returns> 1 if every byte was read, 0 if the connection closed or failed first. </returns>
+uint8_t discard_all(serverSocket connection, uint32_t length)
+{
+	char buffer[4096];
+	while (length > 0)
+	{
+		uint32_t chunk = length < sizeof(buffer) ? length : (uint32_t)sizeof(buffer);
+		if (!receive_all(connection, buffer, chunk))
+		{
+			return 0;
+		}
+		length -= chunk;
+	}
+	return 1;
+}
+
+/// <summary>
+/// Writes exactly the given number of bytes to a connection.
+/// </summary>
+/// <param name="connection"> The connection to write to. </param>
+/// <param name="buffer"> The bytes to write. </param>
+/// <param name="length"> The number of bytes to write. </param>
+/// <returns> 1 if every byte was written, 0 if the connection closed or failed first, which includes the client hanging up. </returns>
+uint8_t send_all(serverSocket connection, const void* buffer, uint32_t length)
+{
+	const char* next = (const char*)buffer;
+	while (length > 0)
+	{
+		int sent = send(connection, next, (int)length, 0);
+		if (sent <= 0)
+		{
+			return 0;
+		}
+		next += sent;
+		length -= (uint32_t)sent;
+	}
+	return 1;
+}
+
+/// <summary>
+/// Runs one request on a warm machine: puts the input into guest memory, runs until the guest stops itself with ecall or ebreak, faults, or reaches the instruction limit, and reads the output back.
+/// </summary>
+/// <param name="machine"> The machine to run on, in the same state as the snapshot. </param>
+/// <param name="request"> The request being served. </param>
+/// <param name="input"> The input bytes of the request. </param>
+/// <param name="response"> Filled in with the state the machine stopped in. </param>
+/// <param name="output"> Filled in with the output block of the request. </param>
+/// <param name="maxInstructions"> The server's instruction limit, used when the request does not give one and as a cap when it does. </param>
+/// <returns> 1 if the request was served, 0 if its input or output block does not fit in RAM, in which case the machine is not touched. </returns>
+uint8_t serve_request(Machine* machine, serverRequest* request, uint8_t* input, serverResponse* response, uint8_t* output, uint64_t maxInstructions)
+{
+	// check both blocks before running, so a rejected request leaves nothing to reset
+	if (!address_in_ram(request->inputAddress, request->inputLength) || !address_in_ram(request->outputAddress, request->outputLength))
+	{
+		return 0;
+	}
+	write_guest_memory(machine, request->inputAddress, input, request->inputLength);
+
+	if (request->maxInstructions != 0 && request->maxInstructions < maxInstructions)
+	{
+		maxInstructions = request->maxInstructions;
+	}
+	uint64_t startInstructions = machine->instructionsRetired;
+	stopReason reason = run(machine, maxInstructions);
+
+	response->stopReason = reason;
+	response->pc = machine->pc;
+	response->instructions = machine->instructionsRetired - startInstructions;
+	read_registers(machine, response->registers);
+	response->outputLength = request->outputLength;
+	response->reserved = 0;
+	read_guest_memory(machine, request->outputAddress, output, request->outputLength);
+	return 1;
+}
+
+/// <summary>
+/// The body of a pool thread. Each thread owns one warm machine, takes connections from the listening socket, and serves every request on a connection in turn.
+/// The machine is reset after each response is sent, so the reset is off the path of the next request as long as the client takes a moment to send it.
+/// </summary>
+/// <param name="listener"> The listening socket, shared by every pool thread. </param>
+/// <param name="machine"> The machine this thread owns. </param>
+/// <param name="snapshot"> The snapshot the machine was cloned from, which is only ever read. </param>
+/// <param name="maxInstructions"> The most instructions any one request can run. </param>
+void run_server_thread(serverSocket listener, Machine* machine, Machine* snapshot, uint64_t maxInstructions)
+{
+	// grown to fit the largest request seen so far, and kept for the next one
+	std::vector<uint8_t> input;
+	std::vector<uint8_t> output;
+
+	while (true)
+	{
+		serverSocket connection = accept(listener, NULL, NULL);
+		if (connection == INVALID_SOCKET)
+		{
+			continue;
+		}
+
+		serverRequest request;
+		while (receive_all(connection, &request, sizeof(request)))
+		{
+			serverResponse response;
+			memset(&response, 0, sizeof(response));
+			response.stopReason = SERVER_REQUEST_REJECTED;
+
+			if (request.inputLength > SERVER_MAX_INPUT || request.outputLength > SERVER_MAX_INPUT)
+			{
+				// too big to hold, but the input still has to be read past to get to the next request
+				if (!discard_all(connection, request.inputLength) || !send_all(connection, &response, sizeof(response)))
+				{
+					break;
+				}
+				continue;
+			}
+
+			if (input.size() < request.inputLength)
+			{
+				input.resize(request.inputLength);
+			}
+			if (output.size() < request.outputLength)
+			{
+				output.resize(request.outputLength);
+			}
+			if (!receive_all(connection, input.data(), request.inputLength))
+			{
+				break;
+			}
+
+			if (!serve_request(machine, &request, input.data(), &response, output.data(), maxInstructions))
+			{
+				if (!send_all(connection, &response, sizeof(response)))
+				{
+					break;
+				}
+				continue;
+			}
+			uint8_t sent = send_all(connection, &response, sizeof(response)) && send_all(connection, output.data(), response.outputLength);
+			reset_machine(machine, snapshot);
+			if (!sent)
+			{
+				break;
+			}
+		}
+		close_socket(connection);
+	}
+}
+
+/// <summary>
+/// Serves requests on a local socket forever, from a pool of machines cloned from a booted snapshot.
+/// Every request starts from the snapshot's state, so requests do not see anything earlier ones did, and only the pages of RAM a request wrote to are copied back afterwards.
+/// </summary>
+/// <param name="snapshot"> The booted machine to clone. It must be in inline cache mode, and is not run again. </param>
+/// <param name="socketPath"> The path of the Unix socket to listen on. Anything already there is replaced. </param>
+/// <param name="poolSize"> The number of machines, and so the number of connections that can be served at the same time. </param>
+/// <param name="maxInstructions"> The most instructions any one request can run, so a guest stuck in a loop only holds its machine for so long. </param>
+/// <returns> Only returns if the server could not start, with -1. </returns>
+int run_server(Machine* snapshot, const char* socketPath, uint32_t poolSize, uint64_t maxInstructions)
+{
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(address.sun_path))
+	{
+		printf("FATAL: socket path %s is too long.\n", socketPath);
+		return -1;
+	}
+	// the length is checked above, and strcpy is an error under the /sdl checks the projects build with
+	memcpy(address.sun_path, socketPath, strlen(socketPath) + 1);
+
+#ifdef _WIN32
+	WSADATA winsockData;
+	if (WSAStartup(MAKEWORD(2, 2), &winsockData) != 0)
+	{
+		printf("FATAL: could not start Winsock.\n");
+		return -1;
+	}
+#endif
+
+#ifndef _WIN32
+	// a client that hangs up before reading its response must only end its own connection, so writes to it fail with EPIPE instead of killing the process
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	serverSocket listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == INVALID_SOCKET)
+	{
+		printf("FATAL: could not create the server socket.\n");
+		return -1;
+	}
+	remove(socketPath);
+	if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, (int)poolSize) != 0)
+	{
+		printf("FATAL: could not listen on %s.\n", socketPath);
+		close_socket(listener);
+		return -1;
+	}
+
+	// boot the whole pool up front, so no request ever waits for a machine
+	std::vector<Machine*> pool;
+	for (uint32_t index = 0; index < poolSize; index++)
+	{
+		Machine* machine = clone_machine(snapshot);
+		if (machine == NULL)
+		{
+			printf("WARNING: not enough memory for more than %u machines.\n", index);
+			break;
+		}
+		pool.push_back(machine);
+	}
+	if (pool.empty())
+	{
+		printf("FATAL: not enough memory for the machine pool.\n");
+		close_socket(listener);
+		return -1;
+	}
+
+	if (maxInstructions == UINT64_MAX)
+	{
+		printf("WARNING: no --max-instructions given, a request that never stops will hold its machine forever.\n");
+	}
+	printf("serving on %s with %u machines\n", socketPath, (uint32_t)pool.size());
+	fflush(stdout);
+
+	std::vector<std::thread> threads;
+	for (Machine* machine : pool)
+	{
+		threads.push_back(std::thread(run_server_thread, listener, machine, snapshot, maxInstructions));
+	}
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+	return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+#include "machine.h"
+
+#define SERVER_MAX_INPUT (64 * 1024 * 1024) // larger inputs or outputs are rejected instead of being served
+#define SERVER_REQUEST_REJECTED 0x100 // sent back as the stopReason of a request that was not run, with no output
+
+/*
+every request on a connection is one of these, followed by inputLength bytes of input
+a request whose input or output block is too big or does not fit in RAM is answered with SERVER_REQUEST_REJECTED, and the connection stays open
+all fields are in the host's byte order, as the client is always on the same computer
+*/
+struct serverRequest
+{
+	uint32_t inputAddress; // where in guest memory to put the input
+	uint32_t inputLength;
+	uint32_t outputAddress; // the block of guest memory to send back once the run has stopped
+	uint32_t outputLength;
+	uint64_t maxInstructions; // 0 for the server's --max-instructions limit, which also caps any other value
+};
+
+/*
+the answer to each request, followed by outputLength bytes of guest memory
+*/
+struct serverResponse
+{
+	uint32_t stopReason; // see machine.h, a run only stops on ecall, ebreak, an access fault or the instruction limit, otherwise SERVER_REQUEST_REJECTED
+	uint32_t pc;
+	uint64_t instructions; // the number of instructions this request ran
+	int32_t registers[32];
+	uint32_t outputLength;
+	uint32_t reserved;
+};
+
+int run_server(Machine* snapshot, const char* socketPath, uint32_t poolSize, uint64_t maxInstructions);
+
+#endif